@@ -5,8 +5,14 @@
 class AgentStats {
 public:
   uint64_t rx_bytes, tx_bytes;
-  uint64_t gets, sets, get_misses;
+  uint64_t gets, sets, get_misses, get_keys;
   uint64_t skips;
+  uint64_t churned;
+
+  // So that client_saturated() sees every process and agent.
+  uint64_t loop_iterations, wakeups, timer_fires;
+  double timer_lateness_sum, timer_lateness_max;
+  double busy_time, busy_max, client_time;
 
   double start, stop;
 };
@@ -0,0 +1,97 @@
+// -*- c++ -*-
+
+#include <stdio.h>
+#include <string.h>
+
+#include "AsciiProtocol.h"
+#include "log.h"
+
+int AsciiProtocol::encode_request(struct evbuffer *out,
+                                  const wire_request_t &req) {
+  const char *noreply = req.quiet ? " noreply" : "";
+  int l;
+
+  switch (req.type) {
+  case Operation::GET:
+    if (req.nkeys == 0) return evbuffer_add_printf(out, "get %s\r\n", req.key);
+
+    l = evbuffer_add_printf(out, "get");
+    for (int i = 0; i < req.nkeys; i++)
+      l += evbuffer_add_printf(out, " %s", req.keys[i]);
+    return l + evbuffer_add_printf(out, "\r\n");
+
+  case Operation::SET:
+    l = evbuffer_add_printf(out, "set %s 0 0 %d%s\r\n", req.key, req.length,
+                            noreply);
+    evbuffer_add(out, req.value, req.length);
+    evbuffer_add(out, "\r\n", 2);
+    return l + req.length + 2;
+
+  case Operation::DELETE:
+    return evbuffer_add_printf(out, "delete %s%s\r\n", req.key, noreply);
+
+  case Operation::NOOP:
+    evbuffer_add(out, "version\r\n", 9);
+    return 9;
+
+  default: DIE("Not implemented.");
+  }
+}
+
+// True if the line at `line', `length' bytes long, is `word'.
+static bool is(const char *line, ssize_t length, const char *word) {
+  return length == (ssize_t) strlen(word) && !memcmp(line, word, length);
+}
+
+size_t AsciiProtocol::try_decode_response(struct evbuffer *in,
+                                          const Operation *expect,
+                                          wire_response_t *r) {
+  size_t eol_len;
+  struct evbuffer_ptr eol =
+    evbuffer_search_eol(in, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+  if (eol.pos < 0) return 0;  // A whole line not received yet.
+
+  size_t n = eol.pos + eol_len;
+  char *line = (char *) evbuffer_pullup(in, n);
+
+  memset(r, 0, sizeof(*r));
+
+  if (!strncmp(line, "VALUE ", 6)) {  // VALUE <key> <flags> <bytes>
+    char *key = line + 6;
+    char *end = (char *) memchr(key, ' ', eol.pos - 6);
+    int length;
+
+    if (end == NULL || sscanf(end, " %*d %d", &length) != 1)
+      DIE("Unexpected result when waiting for VALUE or END");
+
+    n += length + 2;
+    if (evbuffer_get_length(in) < n) return 0;
+    r->hit = true;
+
+    if (expect && expect->keys) {  // --multiget: more VALUEs, or END.
+      r->partial = true;
+      r->key = key;
+      r->keylen = end - key;
+      return n;
+    }
+
+    if (evbuffer_get_length(in) < n + 5) return 0;
+
+    struct evbuffer_ptr at;
+    evbuffer_ptr_set(in, &at, n, EVBUFFER_PTR_SET);
+    if (evbuffer_search(in, "END\r\n", 5, &at).pos != (ssize_t) n)
+      DIE("Unexpected result when waiting for END");
+
+    return n + 5;
+  }
+
+  if (is(line, eol.pos, "END")) {
+    r->failed = !(expect && expect->keys);  // --multiget misses are per key.
+  } else if (!strncmp(line, "VERSION", 7)) {
+    r->fence = true;
+  } else {
+    r->failed = !is(line, eol.pos, "STORED") && !is(line, eol.pos, "DELETED");
+  }
+
+  return n;
+}
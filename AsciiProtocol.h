@@ -0,0 +1,19 @@
+/* -*- c++ -*- */
+#ifndef ASCIIPROTOCOL_H
+#define ASCIIPROTOCOL_H
+
+#include "Protocol.h"
+
+// The classic text protocol.  Responses carry no opaque: they answer
+// requests in order.  A NOOP is a "version", and a quiet SET is sent
+// with noreply.
+class AsciiProtocol final : public Protocol {
+public:
+  AsciiProtocol(const options_t &options) {}
+
+  int encode_request(struct evbuffer *out, const wire_request_t &req);
+  size_t try_decode_response(struct evbuffer *in, const Operation *expect,
+                             wire_response_t *r);
+};
+
+#endif // ASCIIPROTOCOL_H
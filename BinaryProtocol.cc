@@ -0,0 +1,94 @@
+// -*- c++ -*-
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "BinaryProtocol.h"
+#include "binary_protocol.h"
+#include "log.h"
+
+// A request with no value: header and key.
+static int encode_key(struct evbuffer *out, uint8_t opcode,
+                      const char *key, int keylen, uint16_t vbucket,
+                      uint32_t opaque) {
+  binary_header_t h = { 0x80, opcode, htons(keylen),
+                        0x00, 0x00, {htons(vbucket)},
+                        htonl(keylen), opaque };
+
+  evbuffer_add(out, &h, 24);  // size does not include extras
+  evbuffer_add(out, key, keylen);
+  return 24 + keylen;
+}
+
+int BinaryProtocol::encode_request(struct evbuffer *out,
+                                   const wire_request_t &req) {
+  int l = 0;
+
+  switch (req.type) {
+  case Operation::GET:
+    if (req.nkeys == 0)
+      return encode_key(out, req.quiet ? CMD_GETQ : CMD_GET, req.key,
+                        req.keylen, req.vbucket, req.opaque);
+
+    // Quiet: only hits are answered, then the NOOP.
+    for (int i = 0; i < req.nkeys; i++)
+      l += encode_key(out, CMD_GETKQ, req.keys[i], strlen(req.keys[i]),
+                      req.vbucket, 0);
+    break;
+
+  case Operation::SET: {
+    uint8_t opcode = req.quiet ? CMD_SETQ : CMD_SET;
+    binary_header_t h = { 0x80, opcode, htons(req.keylen), 0x08, 0x00,
+                          {htons(req.vbucket)},
+                          htonl(req.keylen + 8 + req.length), req.opaque };
+
+    evbuffer_add(out, &h, 32);  // With extras
+    evbuffer_add(out, req.key, req.keylen);
+    evbuffer_add(out, req.value, req.length);
+    return 32 + req.keylen + req.length;
+  }
+
+  case Operation::DELETE:
+    return encode_key(out, req.quiet ? CMD_DELETEQ : CMD_DELETE, req.key,
+                      req.keylen, req.vbucket, req.opaque);
+
+  case Operation::NOOP:
+    break;
+
+  default: DIE("Not implemented.");
+  }
+
+  binary_header_t h = { 0x80, CMD_NOOP, 0, 0x00, 0x00, {htons(0)}, 0,
+                        req.opaque };
+  evbuffer_add(out, &h, 24);
+  return l + 24;
+}
+
+size_t BinaryProtocol::try_decode_response(struct evbuffer *in,
+                                           const Operation *expect,
+                                           wire_response_t *r) {
+  size_t length = evbuffer_get_length(in);
+  if (length < 24) return 0;
+  binary_header_t* h =
+    reinterpret_cast<binary_header_t*>(evbuffer_pullup(in, 24));
+  size_t n = 24 + ntohl(h->body_len);
+  if (length < n) return 0;  // Not whole response
+
+  memset(r, 0, sizeof(*r));
+  r->has_opaque = true;
+  r->opaque = h->opaque;
+  r->fence = h->opcode == CMD_NOOP;
+  r->failed = h->status != RESP_OK;
+  r->not_my_vbucket = h->status == htons(RESP_NOT_MY_VBUCKET);
+  r->hit = !r->failed && (h->opcode == CMD_GET || h->opcode == CMD_GETQ ||
+                          h->opcode == CMD_GETKQ);
+
+  if (h->opcode == CMD_GETKQ) {  // --multiget: one key's answer.
+    h = reinterpret_cast<binary_header_t*>(evbuffer_pullup(in, n));
+    r->partial = true;
+    r->key = (char *) h + 24 + h->extra_len;
+    r->keylen = ntohs(h->key_len);
+  }
+
+  return n;
+}
@@ -0,0 +1,18 @@
+/* -*- c++ -*- */
+#ifndef BINARYPROTOCOL_H
+#define BINARYPROTOCOL_H
+
+#include "Protocol.h"
+
+// The binary protocol.  Quiet requests use the Q opcodes; a --multiget
+// is a GETKQ per key and a NOOP carrying the opaque of the batch.
+class BinaryProtocol final : public Protocol {
+public:
+  BinaryProtocol(const options_t &options) {}
+
+  int encode_request(struct evbuffer *out, const wire_request_t &req);
+  size_t try_decode_response(struct evbuffer *in, const Operation *expect,
+                             wire_response_t *r);
+};
+
+#endif // BINARYPROTOCOL_H
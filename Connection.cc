@@ -1,4 +1,9 @@
+#include <errno.h>
 #include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -9,23 +14,55 @@
 
 #include "config.h"
 
+#include "AsciiProtocol.h"
+#include "BinaryProtocol.h"
 #include "Connection.h"
+#include "Dataset.h"
 #include "distributions.h"
 #include "Generator.h"
+#include "Ketama.h"
+#include "MetaProtocol.h"
 #include "mutilate.h"
 #include "binary_protocol.h"
+#include "UdpFraming.h"
 #include "util.h"
+#include "VBucketMap.h"
 
-Connection::Connection(struct event_base* _base, struct evdns_base* _evdns,
-                       string _hostname, string _port, options_t _options,
-                       bool sampling) :
-  hostname(_hostname), port(_port), start_time(0),
-  stats(sampling), options(_options), base(_base), evdns(_evdns)
+__thread uint64_t thread_wakeups = 0;
+
+conn_group_t::conn_group_t(const options_t &_options, bool sampling) :
+  options(_options), stats(sampling), sources(NULL),
+  hedger(NULL), protocol(NULL), connects(0), connect_failures(0),
+  connect_sampler(200)
 {
   valuesize = createGenerator(options.valuesize);
   keysize = createGenerator(options.keysize);
   keygen = new KeyGenerator(keysize, options.records);
 
+  iagen = NULL;
+  set_lambda(options.lambda);
+
+  churngen = NULL;
+  if (options.churn_rate > 0 && options.lambda_denom > 0)
+    churngen = new Exponential(options.churn_rate / options.lambda_denom);
+
+  srand48(time(NULL) ^ getpid());
+}
+
+conn_group_t::~conn_group_t() {
+  delete protocol;
+  delete hedger;
+  delete churngen;
+  delete iagen;
+  delete keygen;
+  delete keysize;
+  delete valuesize;
+}
+
+void conn_group_t::set_lambda(double lambda) {
+  options.lambda = lambda;
+  delete iagen;
+
   if (options.lambda <= 0) {
     iagen = createGenerator("0");
   } else {
@@ -33,21 +70,53 @@ Connection::Connection(struct event_base* _base, struct evdns_base* _evdns,
     iagen = createGenerator(options.ia);
     iagen->set_lambda(options.lambda);
   }
+}
+
+void conn_group_t::reset_stats() {
+  qps_window_t *window = stats.window;
+  stats = ConnectionStats(stats.sampling);
+  stats.window = window;
+}
 
+Connection::Connection(struct event_base* _base, struct evdns_base* _evdns,
+                       string _hostname, string _port, conn_group_t* _group,
+                       RunController* _run, TimingWheel* _wheel) :
+  group(_group), stats(_group->stats), options(_group->options),
+  server(0), slot(0), run(_run), run_generation(0), wheel(_wheel),
+  hostname(_hostname), port(_port), start_time(0),
+  base(_base), evdns(_evdns)
+{
   read_state = INIT_READ;
   write_state = INIT_WRITE;
 
-  last_tx = last_rx = 0.0;
+  // The wire format: --meta, --binary or ASCII, in datagrams with --udp.
+  if (options.meta) use<MetaProtocol>();
+  else if (options.binary && options.udp) use<UdpFraming<BinaryProtocol> >();
+  else if (options.binary) use<BinaryProtocol>();
+  else if (options.udp) use<UdpFraming<AsciiProtocol> >();
+  else use<AsciiProtocol>();
+
+  last_tx = last_rx = 0;
+  memset(&ratioStats, 0, sizeof(ratioStats));
+
+  loader_cursor = NULL;
+  loader_completed = loader_bytes = loader_errors = 0;
+  loader_next = loader_end = 0;
+  loader_head = loader_inflight = 0;
+
+  churn_issued = 0;
+  next_churn = 0;
+  fresh = false;
+  routed_in = routed_out = 0;
+  batch_next = batch_hits = 0;
+  seq = 0;
+  fences = unfenced = 0;
+  fence_opaque = 0;
+  reconnect_delay = 0;
 
   if (!options.udp) {
-    bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_setcb(bev, bev_read_cb, bev_write_cb, bev_event_cb, this);
-    bufferevent_enable(bev, EV_READ | EV_WRITE);
-
-    if (bufferevent_socket_connect_hostname(bev, evdns, AF_UNSPEC,
-                                          hostname.c_str(),
-                                          atoi(port.c_str())))
-      DIE("bufferevent_socket_connect_hostname()");
+    connect_attempts = 0;
+    start_connect();
   }
   // TODO: make UDP mode IPvX-agnostic
   else {
@@ -76,8 +145,6 @@ Connection::Connection(struct event_base* _base, struct evdns_base* _evdns,
     ev = event_new(base, fd, EV_READ | EV_PERSIST, udp_event_cb, this);
     read_state = IDLE;
     // D("UDP socket %s:%s writable.", hostname.c_str(), port.c_str());
-    memset(udpHdr, 0, sizeof(udpHdr));
-    udpHdr[5] = 1;    // want to send only 1 datagram
 
     timeout = {3, 0};
     event_add(ev, &timeout);
@@ -86,38 +153,164 @@ Connection::Connection(struct event_base* _base, struct evdns_base* _evdns,
     write = evbuffer_new();
   }
 
-  srand48(time(NULL));
-  timer = evtimer_new(base, timer_cb, this);
+  timer = wheel ? NULL : evtimer_new(base, timer_cb, this);
+  wheel_node.cb = wheel_cb;
+  wheel_node.arg = this;
+}
+
+// Open the TCP connection, bound to the next --source_addr if any.
+// bev_callback() hears how it went.
+void Connection::start_connect() {
+  connect_start = get_ns();
+  connect_attempts++;
+
+  if (group->sources == NULL) {
+    bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(bev, bev_read_cb, bev_write_cb, bev_event_cb, this);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+    if (bufferevent_socket_connect_hostname(bev, evdns, AF_UNSPEC,
+                                          hostname.c_str(),
+                                          atoi(port.c_str())))
+      DIE("bufferevent_socket_connect_hostname()");
+    return;
+  }
+
+  source_addrs_t *src = group->sources;
+  unsigned int i = __atomic_fetch_add(&src->next, 1, __ATOMIC_RELAXED) %
+    src->addrs.size();
+
+  // hostname is numeric by now; see name_to_ipaddr().
+  struct sockaddr_storage dst;
+  int dst_len = sizeof(dst);
+  string peer = hostname.find(':') == string::npos ?
+    hostname + ":" + port : "[" + hostname + "]:" + port;
+  if (evutil_parse_sockaddr_port(peer.c_str(), (struct sockaddr *) &dst,
+                                 &dst_len))
+    DIE("Can't bind connections to %s: not a numeric address", peer.c_str());
+
+  evutil_socket_t fd = socket(dst.ss_family, SOCK_STREAM, 0);
+  if (fd < 0) DIE("socket() failed: %s", strerror(errno));
+  evutil_make_socket_nonblocking(fd);
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  // Pick the port at connect() time, so that ports are only unique
+  // per destination, not per source address.
+  int one = 1;
+  setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+
+  bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_setcb(bev, bev_read_cb, bev_write_cb, bev_event_cb, this);
+  bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+  if (bind(fd, (struct sockaddr *) &src->addrs[i], src->lens[i])) {
+    connect_failed(strerror(errno));
+    return;
+  }
+
+  if (bufferevent_socket_connect(bev, (struct sockaddr *) &dst, dst_len))
+    connect_failed(strerror(errno));
+}
+
+// Count a failed attempt and try again, up to CONNECT_ATTEMPTS.  With
+// --reconnect, a Connection that was up keeps trying until the run
+// ends, and then stays down until the next one.
+void Connection::connect_failed(const char *why) {
+  group->connect_failures++;
+  V("Connecting to %s:%s failed: %s", hostname.c_str(), port.c_str(), why);
+
+  if (options.reconnect && write_state == CONNECTING) {
+    bufferevent_free(bev);
+    bev = NULL;
+
+    if (run->expired) {
+      write_state = BACKING_OFF;  // Not armed: see drive_write_machine().
+      leave_run();
+      return;
+    }
+
+    stats.log_fault(get_ns());
+    backoff();
+    return;
+  }
+
+  if (connect_attempts >= CONNECT_ATTEMPTS)
+    DIE("Could not connect to %s:%s after %d attempts: %s",
+        hostname.c_str(), port.c_str(), connect_attempts, why);
+
+  bufferevent_free(bev);
+  start_connect();
 }
 
 Connection::~Connection() {
-  event_free(timer);
+  disarm_timer();
+  if (timer) event_free(timer);
   timer = NULL;
 
   // FIXME:  W("Drain op_q?");
 
   // bufferevent already set to close on free
-  if (!options.udp) bufferevent_free(bev);
+  if (!options.udp) {
+    if (bev) bufferevent_free(bev);  // NULL while backing off.
+  }
   else {
     close(event_get_fd(ev));
     event_free(ev);
     evbuffer_free(read);
     evbuffer_free(write);
   }
-
-  delete iagen;
-  delete keygen;
-  delete keysize;
-  delete valuesize;
 }
 
 void Connection::reset() {
   // FIXME: Actually check the connection, drain all bufferevents, drain op_q.
   assert(op_queue.size() == 0);
-  evtimer_del(timer);
+  if (read_state == INIT_READ) return;  // Down: --reconnect.
+  disarm_timer();
   read_state = IDLE;
   write_state = INIT_WRITE;
-  stats = ConnectionStats(stats.sampling);
+  churn_issued = 0;
+  fresh = false;
+}
+
+// --churn: close the connection and open a new one.
+void Connection::churn() {
+  if (group->churngen) {
+    int64_t now = get_ns();
+    if (next_churn < now) next_churn = now;
+    next_churn += group->churngen->generate() * 1000000000;
+  }
+
+  bufferevent_free(bev);
+  read_state = INIT_READ;
+  write_state = CONNECTING;
+  churn_issued = 0;
+  connect_attempts = 0;
+  start_connect();
+}
+
+// Connected, and authenticated if --username was given.
+void Connection::ready() {
+  read_state = IDLE;  // This is the most important part!
+
+  if (write_state != CONNECTING) {
+    leave_run();
+    return;
+  }
+
+  // Reopened by churn() or fault(): back to work, unless the run ended
+  // meanwhile.
+  if (reconnect_delay) {
+    stats.reconnects++;
+    reconnect_delay = 0;
+  } else {
+    stats.churned++;
+    fresh = true;
+  }
+  write_state = INIT_WRITE;
+
+  if (run->expired) leave_run();
+  else drive_write_machine();
 }
 
 void Connection::issue_sasl() {
@@ -136,214 +329,136 @@ void Connection::issue_sasl() {
   bufferevent_write(bev, password.c_str(), password.length());
 }
 
-void Connection::issue_get(const char* key, double now) {
+// Queue an Operation for `req' and send it.  Returns the bytes sent.
+int Connection::issue(Operation::type_enum type, wire_request_t &req,
+                      int64_t now, request_t *request) {
   Operation op;
-  int l;
-  uint16_t keylen = strlen(key);
-
-#if HAVE_CLOCK_GETTIME
-  op.start_time = get_time_accurate();
-#else
-  if (now == 0.0) {
-#if USE_CACHED_TIME
-    struct timeval now_tv;
-    event_base_gettimeofday_cached(base, &now_tv);
-
-    op.start_time = tv_to_double(&now_tv);
-#else
-    op.start_time = get_time();
-#endif
-  } else {
-    op.start_time = now;
-  }
-#endif
 
-  op.type = Operation::GET;
-  op.key = string(key);
+  if (now == 0) now = get_ns();
+  op.start_time = now;
+  op.request = request;
+  op.issuer = NULL;
+  op.keys = req.nkeys;
+  op.opaque = seq++;
+  op.type = type;
 
   op_queue.push(op);
 
   if (read_state == IDLE)
-    read_state = WAITING_FOR_GET;
-
-if (options.binary) {
-    // each line is 4-bytes
-    binary_header_t h = {0x80, CMD_GET, htons(keylen),
-                       0x00, 0x00, {htons(0)}, //TODO(syang0) get actual vbucket?
-                       htonl(keylen) };
-                       
-    if (options.udp) {
-      evbuffer_add(write, udpHdr, sizeof(udpHdr));
-      evbuffer_add(write, &h, 24);  // size does not include extras
-      evbuffer_add(write, key, keylen);
-      l = sizeof(udpHdr) + 24 + keylen;
-
-      // char foo[500];
-      // memset(foo, 0, 500);
-      // evbuffer_copyout(write, &foo, evbuffer_get_length(write));
-
-      evbuffer_write(write, event_get_fd(ev));
-    }
-    else {
-      bufferevent_write(bev, &h, 24); // size does not include extras
-      bufferevent_write(bev, key, keylen);
-      l = 24 + keylen;
-    }
-  } else {
-    char getHdr[] = "get %s\r\n";
-    if (options.udp) {
-      evbuffer_add(write, udpHdr, sizeof(udpHdr));
-      l = sizeof(udpHdr) + evbuffer_add_printf(write, getHdr,
-                                key);
+    read_state = WAITING_FOR_RESPONSE;
 
-      evbuffer_write(write, event_get_fd(ev));
-    }
-    else l = evbuffer_add_printf(bufferevent_get_output(bev), "get %s\r\n", key);
-  }
+  req.type = type;
+  req.opaque = op.opaque;
+  return (this->*send)(req);
+}
+
+void Connection::issue_get(const char* key, int64_t record, int64_t now,
+                           request_t *request) {
+  wire_request_t req = {};
+  req.key = key;
+  req.keylen = strlen(key);
+  req.vbucket = vbucket(record);
+  req.quiet = options.quiet_ops;
 
+  int l = issue(Operation::GET, req, now, request);
   if (read_state != LOADING) stats.tx_bytes += l;
 }
 
-void Connection::issue_set(const char* key, const char* value, int length,
-                           double now) {
-  Operation op;
-  int l;
-  uint16_t keylen = strlen(key);
-
-#if HAVE_CLOCK_GETTIME
-  op.start_time = get_time_accurate();
-#else
-  if (now == 0.0) op.start_time = get_time();
-  else op.start_time = now;
-#endif
+void Connection::issue_set(const char* key, int64_t record,
+                           const char* value, int length, int64_t now) {
+  wire_request_t req = {};
+  req.key = key;
+  req.keylen = strlen(key);
+  req.value = value;
+  req.length = length;
+  req.vbucket = vbucket(record);
+  // --measure_load waits for every answer.
+  req.quiet = options.quiet_ops && read_state != LOADING;
+
+  int l = issue(Operation::SET, req, now);
+  stats.tx_bytes += l;
+  // Only --measure_load sets while LOADING.  stats is the thread's, so
+  // count this Connection's own bytes.
+  if (read_state == LOADING) loader_bytes += l;
+}
 
-  op.type = Operation::SET;
-  op_queue.push(op);
+void Connection::issue_delete(const char* key, int64_t record,
+                              int64_t now) {
+  wire_request_t req = {};
+  req.key = key;
+  req.keylen = strlen(key);
+  req.vbucket = vbucket(record);
+  req.quiet = options.quiet_ops;
 
-  if (read_state == IDLE)
-    read_state = WAITING_FOR_SET;
-
-  if (options.binary) {
-    // each line is 4-bytes
-    binary_header_t h = { 0x80, CMD_SET, htons(keylen),
-                        0x08, 0x00, {htons(0)}, //TODO(syang0) get actual vbucket?
-                        htonl(keylen + 8 + length)};
-
-    if (options.udp) {
-      evbuffer_add(write, udpHdr, sizeof(udpHdr));
-      evbuffer_add(write, &h, 32);  // With extras
-      evbuffer_add(write, key, keylen);
-      evbuffer_add(write, value, length);
-      l = sizeof(udpHdr) + sizeof(h) + keylen + length;
-
-      evbuffer_write(write, event_get_fd(ev));
-    }
-    else {
-      bufferevent_write(bev, &h, 32); // With extras
-      bufferevent_write(bev, key, keylen);
-      bufferevent_write(bev, value, length);
-      l = 24 + h.body_len;
-    }
-  }
-  else {
-    char setHdr[] = "set %s 0 0 %d\r\n";
+  int l = issue(Operation::DELETE, req, now);
+  if (read_state != LOADING) stats.tx_bytes += l;
+}
 
-    if (options.udp) {
-      evbuffer_add(write, udpHdr, sizeof(udpHdr));
+// --quiet_ops: a NOOP after the requests sent since the last one.  Its
+// answer completes those that were not answered themselves.  One at a
+// time: requests sent meanwhile wait for the next, which goes out when
+// this one is answered and the write machine runs again.
+void Connection::fence(int64_t now) {
+  if (!options.quiet_ops || unfenced == 0 || fences > 0) return;
 
-      l = sizeof(udpHdr) + evbuffer_add_printf(write, setHdr,
-                                key, length);
+  wire_request_t req = {};
+  stats.tx_bytes += issue(Operation::NOOP, req, now);
 
-      evbuffer_add(write, value, length);
-      evbuffer_add(write, "\r\n", 2);
+  fences++;
+  unfenced = 0;
+  fence_opaque = op_queue.back().opaque;  // --meta: MN carries no opaque.
+}
 
-      evbuffer_write(write, event_get_fd(ev));
-    }
-    else {
-      l = evbuffer_add_printf(bufferevent_get_output(bev),
-                                setHdr, key, length);
-      bufferevent_write(bev, value, length);
-      bufferevent_write(bev, "\r\n", 2);
-    }
+// --multiget: one GET for options.multiget random records.
+void Connection::issue_multiget(int64_t now) {
+  vector<const char *> keys(options.multiget);
 
-    l += length + 2;
+  for (int i = 0; i < options.multiget; i++) {
+    char key[256];
+    record_key(lrand48() % options.records, key);
+    batch_keys.push_back(key);
+    keys[i] = batch_keys.back().c_str();
   }
 
-  if (read_state != LOADING) stats.tx_bytes += l;
-  loadedKeys.insert(atoll(key));
-}
+  wire_request_t req = {};
+  req.keys = &keys[0];
+  req.nkeys = options.multiget;
 
-void Connection::issue_delete(const char* key, double now) {
-  Operation op;
-  int l;
-  uint16_t keylen = strlen(key); 
-
-#if HAVE_CLOCK_GETTIME
-  op.start_time = get_time_accurate();
-#else
-  if (now == 0.0) {
-#if USE_CACHED_TIME
-    struct timeval now_tv;
-    event_base_gettimeofday_cached(base, &now_tv);
-
-    op.start_time = tv_to_double(&now_tv);
-#else
-    op.start_time = get_time();
-#endif
-  } else {
-    op.start_time = now;
-  }
-#endif
-
-  op.type = Operation::DELETE;
-  op.key = string(key);
+  stats.tx_bytes += issue(Operation::GET, req, now);
+}
 
-  op_queue.push(op);
+// --multiget: a hit for `key' of the first batch.  Servers answer in
+// request order and skip misses, so look for it from the last hit on.
+void Connection::match_key(const char *key, int length) {
+  int keys = op_queue.front().keys;
 
-  if (read_state == IDLE)
-    read_state = WAITING_FOR_DELETE;
-
-  if (options.binary) {
-    // each line is 4-bytes
-    binary_header_t h = {0x80, CMD_DELETE, htons(keylen),
-                       0x00, 0x00, {htons(0)}, //TODO(syang0) get actual vbucket?
-                       htonl(keylen) };
-                       
-    if (options.udp) {
-      evbuffer_add(write, udpHdr, sizeof(udpHdr));
-      evbuffer_add(write, &h, 24);  // size does not include extras
-      evbuffer_add(write, key, keylen);
-      l = sizeof(udpHdr) + 24 + keylen;
-
-      // char foo[500];
-      // memset(foo, 0, 500);
-      // evbuffer_copyout(write, &foo, evbuffer_get_length(write));
-
-      evbuffer_write(write, event_get_fd(ev));
-    }
-    else {
-      bufferevent_write(bev, &h, 24); // size does not include extras
-      bufferevent_write(bev, key, keylen);
-      l = 24 + keylen;
-    }
-  } else {
-    char getHdr[] = "delete %s\r\n";
-    if (options.udp) {
-      evbuffer_add(write, udpHdr, sizeof(udpHdr));
-      l = sizeof(udpHdr) + evbuffer_add_printf(write, getHdr,
-                                key);
+  for (; batch_next < keys; batch_next++) {
+    const string &k = batch_keys[batch_next];
 
-      evbuffer_write(write, event_get_fd(ev));
+    if ((int) k.length() == length && !memcmp(k.data(), key, length)) {
+      batch_next++;
+      batch_hits++;
+      return;
     }
-    else l = evbuffer_add_printf(bufferevent_get_output(bev), "delete %s\r\n", key);
   }
 
-  if (read_state != LOADING) stats.tx_bytes += l;
+  DIE("Multi-get answered a key that was not asked for: %.*s", length, key);
+}
+
+// --multiget: the first batch is answered.  Keys without a hit missed.
+void Connection::finish_multiget() {
+  Operation &op = op_queue.front();
+
+  stats.get_keys += op.keys;
+  stats.get_misses += op.keys - batch_hits;
+
+  batch_keys.erase(batch_keys.begin(), batch_keys.begin() + op.keys);
+  batch_next = batch_hits = 0;
 }
 
 // generate key from loader_issued, possibly?
 // this would be sequential, and therefore possibly bad
-void Connection::issue_something(double now) {
+void Connection::issue_something(int64_t now) {
   // int key_index = lrand48() % options.records;
   // generate_key(key_index, options.keysize, key);
 
@@ -351,11 +466,6 @@ void Connection::issue_something(double now) {
 
   /* Note that use of ratio overrides --update. */
   if (options.ratioSum) {
-    char key[256];
-    // FIXME: generate key distribution here!
-    string keystr = keygen->generate(lrand48() % options.records);
-    strcpy(key, keystr.c_str());
-
     int cycleIndex = lrand48() % options.ratioSum;
 
     int opToPerform;
@@ -364,183 +474,374 @@ void Connection::issue_something(double now) {
       if (cycleIndex < 0) break;
     }
 
-    // printf("\t opToPerform: %d\n", opToPerform);
-
-    // idea = generate the key randomly, check for it, then
-    // while (<<generate new key>>)
-    /*printf("\t\topToPerform: %d\n", opToPerform); */
-    //while (1) {
-      // char key[256];
-      // // \/ would be a distribution
-      // key_t numericKey = lrand48() % options.records;
-      // string cppkey = keygen->generate(numericKey);
-      // strcpy(key, cppkey.c_str());
-      switch(opToPerform) {
-        case 0: {
-          // stop program... for now
-          if (absentKeys.empty()) {
-            DIE("All keys set; cannot set absent key");
-          }
-          key_t keyInQuestion = absentKeys.front();
-          absentKeys.pop();
-          loadedKeys.insert(keyInQuestion);
-          char key2[256];
-          int index = keyInQuestion % (1024 * 1024);
-          string keystr2 = keygen->generate(keyInQuestion);
-          strcpy(key2, keystr2.c_str());
-        
-        issue_set(key, &random_char[index], valuesize->generate());
-        // loader_issued++;
-
-          ratioStats.sa++;
-        }; break;
-        case 1: {
-          ratioStats.slss++;
-          //randomCheck needed...
-          // would generate range [to get from] here
-          if (!loadedKeys.count(atoll(key))){
-            issue_get(key, now);
-            return;
-          }
-          int index = atoll(key) % (1024 * 1024);
-          issue_set(key, &random_char[index], valuesize->generate(), now);
-        }; break;
-        case 2: {
-          ratioStats.slds++;
-          // randomCheck needed, same as above...
-          issue_get(key, now);
-        }; break;
-        case 3: {
-          ratioStats.ga++;
-          // this actually does what it's supposed to
-          if (absentKeys.empty()) {
-            // SKIP_THIS_TURN?  defaulting to issue_get(...)...
-            issue_get(key, now);
-            return;
-          }
-          key_t keyInQuestion = absentKeys.front();
-          absentKeys.pop();               // if didn't do this...
-          absentKeys.push(keyInQuestion); // wouldn't even need to do this
-          char key2[256];
-          string keystr2 = keygen->generate(keyInQuestion);
-          strcpy(key2, keystr2.c_str());
-        
-        issue_get(key2, now);
-        // loader_issued++;
-        }; break;
-        case 4: {
-          ratioStats.gl++;
-          if (loadedKeys.count(atoll(key))) {
-            issue_get(key, now);
-            return;
-          }
-          // dummy below, not above
-          issue_get(key, now);
-        }; break;
-        case 5: {
-          ratioStats.da++;
-          if (absentKeys.empty()) {
-            // SKIP_THIS_TURN?  defaulting to issue_get(...)...
-            issue_get(key, now);
-            return;
-          }
-          key_t keyInQuestion = absentKeys.front();
-          absentKeys.pop();               // if didn't do this...
-          absentKeys.push(keyInQuestion); // wouldn't even need to do this
-          char key2[256];
-          string keystr2 = keygen->generate(keyInQuestion);
-          strcpy(key2, keystr2.c_str());
-        
-        issue_delete(key2, now);
-        // loader_issued++;
-
-        }; break;
-        case 6: {
-          ratioStats.dl++;
-          if (loadedKeys.count(atoll(key))) {
-            issue_delete(key, now);
-            absentKeys.push(atoll(key)); 
-            return;
-          }
-          issue_get(key, now);
-        }; break;
-      }
-    //}
+    // Pick a loaded or an absent record to match the operation.  If
+    // there is none, or for slds, which is not implemented, get a
+    // random record instead.
+    bool loaded = opToPerform == 1 || opToPerform == 4 || opToPerform == 6;
+    KeyBitmap *keys =
+      group->key_state[group->key_state.size() > 1 ? server : 0];
+    int64_t record = keys->random(loaded);
+    bool fallback = record < 0 || opToPerform == 2;
+    if (record < 0) record = lrand48() % options.records;
+
+    char key[256];
+    record_key(record, key);
+
+    Connection *conn = route(record);
+    if (conn->read_state == INIT_READ) {  // Down: --reconnect.
+      stats.failed_ops++;
+      return;
+    }
+
+    switch (opToPerform) {
+    case 0: ratioStats.sa++; break;
+    case 1: ratioStats.slss++; break;
+    case 2: ratioStats.slds++; break;
+    case 3: ratioStats.ga++; break;
+    case 4: ratioStats.gl++; break;
+    case 5: ratioStats.da++; break;
+    case 6: ratioStats.dl++; break;
+    }
+
+    if (fallback || opToPerform == 3 || opToPerform == 4) {
+      conn->issue_get(key, record, now);
+    } else if (opToPerform <= 1) {
+      int length;
+      const char *value = record_value(record, key, &length);
+      conn->issue_set(key, record, value, length, now);
+      keys->set(record);
+    } else {
+      conn->issue_delete(key, record, now);
+      keys->clear(record);
+    }
+
+    hand_off(conn);
   }
   else {
     char key[256];
     // FIXME: generate key distribution here!
-    string keystr = keygen->generate(lrand48() % options.records);
-    strcpy(key, keystr.c_str());
+    int64_t record = lrand48() % options.records;
+    record_key(record, key);
+
+    Connection *conn = route(record);
+    if (conn->read_state == INIT_READ) {  // Down: --reconnect.
+      stats.failed_ops++;
+      return;
+    }
+
     if (drand48() < options.update) {
-      // int index = lrand48() % (1024 * 1024);
-      // use atoll, not atoi?
-      int index = atoi(key) % (1024 * 1024);
-      //    issue_set(key, &random_char[index], options.valuesize, now);
-      issue_set(key, &random_char[index], valuesize->generate(), now);
+      int length;
+      const char *value = record_value(record, key, &length);
+      conn->issue_set(key, record, value, length, now);
+      hand_off(conn);
+    } else if (options.multiget) {
+      issue_multiget(now);
+    } else if (options.fanout) {
+      issue_fanout(now);
+    } else if (group->hedger) {
+      vector<Connection*> &pool =
+        group->pools[(server + 1) % group->pools.size()];
+
+      request_t *r = new request_t();
+      r->start_time = now;
+      r->record = record;
+      r->replica = pool[slot % pool.size()];
+      r->pending = 1;
+      stats.requests++;
+
+      issue_get(key, record, now, r);
+      group->hedger->track(r);
+    } else {
+      conn->issue_get(key, record, now);
+      hand_off(conn);
     }
-    else {
-      issue_get(key, now);
+  }
+}
+
+// --ketama, --vbuckets: the server that owns `record', or -1.
+static int owner(int64_t record) {
+  if (ketama) return ketama->owner(record);
+  if (vbuckets) return vbuckets->owner(record);
+  return -1;
+}
+
+// --ketama, --vbuckets: the Connection of this thread to the server
+// that owns `record', or this one.
+Connection *Connection::route(int64_t record) {
+  int s = owner(record);
+  if (s < 0 || s == server) return this;
+
+  vector<Connection*> &pool = group->pools[s];
+  return pool[slot % pool.size()];
+}
+
+// --ketama: charge the Operation just queued on `conn' to this
+// Connection's --depth.
+void Connection::hand_off(Connection *conn) {
+  if (conn == this) return;
+
+  conn->op_queue.back().issuer = this;
+  conn->routed_in++;
+  routed_out++;
+}
+
+// Finish with the Operation at the front of the queue.
+void Connection::release(Operation &op, bool answered) {
+  if (op.request) finish_request(op, answered);
+
+  if (op.issuer) {
+    op.issuer->routed_out--;
+    routed_in--;
+  }
+
+  if (op.type == Operation::NOOP) fences--;
+}
+
+// --vbuckets: the vBucket of `record' for the binary header, or 0.
+// main() hashed every record's key up front.
+uint16_t Connection::vbucket(int64_t record) {
+  return vbuckets ? vbuckets->records[record] : 0;
+}
+
+// --reconnect: drop the connection, failing every request in flight on
+// it, and open a new one after a backoff.
+void Connection::fault(const char *why) {
+  int64_t now = get_ns();
+
+  V("%s:%s: %s; reconnecting.", hostname.c_str(), port.c_str(), why);
+
+  stats.failed_ops += op_queue.size();
+  stats.log_fault(now, op_queue.size() + 1);
+
+  // Down first: --ketama issuers woken by the drain must not route here.
+  read_state = INIT_READ;
+  drain_op_queue();
+
+  bufferevent_free(bev);
+  bev = NULL;
+  disarm_timer();
+  churn_issued = 0;
+  fresh = false;
+  connect_attempts = 0;
+  backoff();
+}
+
+void Connection::backoff() {
+  reconnect_delay = reconnect_delay ?
+    std::min<int64_t>(reconnect_delay * 2, RECONNECT_BACKOFF_MAX) :
+    RECONNECT_BACKOFF_MIN;
+
+  write_state = BACKING_OFF;
+  arm_timer(get_ns(), reconnect_delay);
+}
+
+// --timeout: responses come back in order, so only the oldest request
+// can be the first to be overdue.  There is no telling a late response
+// from the next one, so a timeout costs the connection.
+void Connection::check_timeout(int64_t now) {
+  if (op_queue.size() == 0) return;
+  if (read_state == INIT_READ || read_state == LOADING) return;
+  if (now - op_queue.front().start_time < options.timeout) return;
+
+  stats.timeouts++;
+  fault("request timed out");
+}
+
+// --hedge: send the duplicate of a GET whose first copy is overdue.
+void Connection::hedge(request_t *r, int64_t now) {
+  if (read_state == INIT_READ || run->expired) return;  // Down, or done.
+
+  char key[256];
+  record_key(r->record, key);
+
+  r->pending++;
+  r->hedged = true;
+  stats.hedges++;
+  issue_get(key, r->record, now, r);
+}
+
+// --fanout: one request made of GETs to this and the next fanout - 1
+// servers, each for a record of its own.  It is answered when every
+// part is.
+void Connection::issue_fanout(int64_t now) {
+  request_t *r = new request_t();
+  r->start_time = now;
+  r->origin = server;
+  r->ends.resize(options.fanout, 0);
+  r->pending = options.fanout + 1;  // Until all parts are sent.
+  stats.requests++;
+
+  for (int i = 0; i < options.fanout; i++) {
+    vector<Connection*> &pool =
+      group->pools[(server + i) % group->pools.size()];
+    Connection *conn = pool[slot % pool.size()];
+
+    if (conn->read_state == INIT_READ) {  // Down: --reconnect.
+      r->failed = true;
+      r->pending--;
+      continue;
     }
+
+    char key[256];
+    int64_t record = lrand48() % options.records;
+    record_key(record, key);
+    conn->issue_get(key, record, now, r);
   }
+
+  if (--r->pending == 0) delete r;
 }
 
-void Connection::pop_op() {
+// An Operation of a logical request is answered, or failed.
+void Connection::finish_request(Operation &op, bool answered) {
+  request_t *r = op.request;
+
+  if (options.fanout) {
+    int n = group->pools.size();
+
+    if (answered) r->ends[(server - r->origin + n) % n] = get_ns();
+    else r->failed = true;
+
+    if (--r->pending > 0) return;
+
+    if (!r->failed) {
+      int64_t slowest = 0;
+      for (size_t k = 0; k < r->ends.size(); k++) {
+        slowest = std::max(slowest, r->ends[k]);
+        stats.log_fanout(k + 1, (slowest - r->start_time) / 1000.0);
+      }
+      stats.log_request((slowest - r->start_time) / 1000.0);
+    }
+
+    delete r;
+    return;
+  }
+
+  bool duplicate = r->hedged && r->replica == this;
+
+  if (answered) {
+    double us = (get_ns() - r->start_time) / 1000.0;
+
+    if (!r->done) {
+      r->done = true;
+      stats.log_request(us);
+      if (duplicate) stats.hedge_wins++;
+    }
+
+    if (!duplicate && group->hedger) group->hedger->sample(us);
+  }
+
+  if (--r->pending == 0) delete r;
+}
+
+// Log the latency of a GET or SET that just completed.
+void Connection::log_latency(Operation &op) {
+  if (op.type == Operation::GET) stats.log_get(op);
+  else stats.log_set(op);
+
+  if (ketama || vbuckets) stats.log_server(server);
+
+  if (fresh) {  // --churn
+    stats.log_fresh(op);
+    fresh = false;
+  }
+}
+
+void Connection::pop_op(bool answered) {
   assert(op_queue.size() > 0);
 
+  Connection *issuer = op_queue.front().issuer;
+  release(op_queue.front(), answered);
   op_queue.pop();
 
   if (read_state == LOADING) return;
   read_state = IDLE;
 
+  // Draining after the run: leave once the last response is in.
+  if (op_queue.size() == 0 && run->expired) leave_run();
+
   // Advance the read state machine.
-  if (op_queue.size() > 0) {
-    Operation& op = op_queue.front();
-    switch (op.type) {
-    case Operation::GET: read_state = WAITING_FOR_GET; break;
-    case Operation::SET: read_state = WAITING_FOR_SET; break;
-    case Operation::DELETE: read_state = WAITING_FOR_DELETE; break;
-    default: DIE("Not implemented.");
-    }
+  if (op_queue.size() > 0) read_state = WAITING_FOR_RESPONSE;
+
+  // --churn: the last response is in.  Reopen once --churn_rate allows.
+  if (write_state == CLOSING && op_queue.size() == 0 && !run->expired) {
+    int64_t now = get_ns();
+    arm_timer(now, next_churn > now ? next_churn - now : 0);
   }
+
+  // --ketama: the issuer has room for another request.
+  if (issuer) issuer->drive_write_machine();
 }
 
-// Right now, timeout is the only way to stop testing.
-bool Connection::check_exit_condition(double now) {
+// Right now, timeout is the only way to stop testing.  The deadline
+// is kept once per thread by the RunController, so this is cheap.
+bool Connection::check_exit_condition() {
   if (read_state == INIT_READ) return false;
-  if (now == 0.0) now = get_time();
-  if (now > start_time + options.time) return true;
+  if (run->expired) return true;
   if (options.loadonly && read_state == IDLE) return true;
   return false;
 }
 
+void Connection::join_run() {
+  run_generation = run->generation;
+  run->join();
+}
+
+void Connection::leave_run() {
+  if (run_generation != run->generation) return;
+  run_generation = 0;
+  run->leave();
+}
+
+void Connection::arm_timer(int64_t now, int64_t delay) {
+  if (wheel) {
+    wheel->schedule(&wheel_node, now + delay);
+  } else {
+    struct timeval tv;
+    ns_to_tv(delay, &tv);
+    evtimer_add(timer, &tv);
+  }
+}
+
+bool Connection::timer_pending() {
+  if (wheel) return wheel_node.pending();
+  return event_pending(timer, EV_TIMEOUT, NULL);
+}
+
+void Connection::disarm_timer() {
+  if (wheel) wheel->cancel(&wheel_node);
+  else evtimer_del(timer);
+}
+
 // drive_write_machine() determines whether or not to issue a new
 // command.  Note that this function loops.  Be wary of break
 // vs. return.
 
-void Connection::drive_write_machine(double now) {
-  if (now == 0.0) now = get_time();
+void Connection::drive_write_machine(int64_t now) {
+  if (now == 0) now = get_ns();
 
-  double delay;
-  struct timeval tv;
+  int64_t delay;
 
-  if (check_exit_condition(now)) return;
+  if (check_exit_condition()) {
+    fence(now);
+    leave_run();
+    return;
+  }
 
   while (1) {
     switch (write_state) {
     case INIT_WRITE:
-      delay = iagen->generate();
+      delay = group->iagen->generate() * 1000000000;
 
       next_time = now + delay;
-      double_to_tv(delay, &tv);
-      evtimer_add(timer, &tv);
+      arm_timer(now, delay);
 
       write_state = WAITING_FOR_TIME;
       break;
 
     case ISSUING:
-      if (op_queue.size() >= (size_t) options.depth) {
+      if (outstanding() >= (size_t) options.depth) {
         write_state = WAITING_FOR_OPQ;
+        fence(now);
         return;
       } else if (now < next_time) {
         write_state = WAITING_FOR_TIME;
@@ -548,45 +849,53 @@ void Connection::drive_write_machine(double now) {
                // to make sure the timer is armed.
         //      } else if (options.moderate && options.lambda > 0.0 &&
         //                 now < last_rx + 0.25 / options.lambda) {
-      } else if (options.moderate && now < last_rx + 0.00025) {
+      } else if (options.moderate && now < last_rx + 250000) {
         write_state = WAITING_FOR_TIME;
-        if (!event_pending(timer, EV_TIMEOUT, NULL)) {
+        if (!timer_pending()) {
           //          delay = last_rx + 0.25 / options.lambda - now;
-          delay = last_rx + 0.00025 - now;
+          delay = last_rx + 250000 - now;
           //          I("MODERATE %f %f %f %f %f", now - last_rx, 0.25/options.lambda,
             //            1/options.lambda, now-last_tx, delay);
           
-          double_to_tv(delay, &tv);
-          evtimer_add(timer, &tv);
+          arm_timer(now, delay);
         }
+        fence(now);
         return;
       }
 
       issue_something(now);
+      unfenced++;
       last_tx = now;
       stats.log_op(op_queue.size());
 
-      next_time += iagen->generate();
+      next_time += group->iagen->generate() * 1000000000;
 
       if (options.skip && options.lambda > 0.0 &&
-          now - next_time > 0.005000 &&
-          op_queue.size() >= (size_t) options.depth) {
+          now - next_time > 5000000 &&
+          outstanding() >= (size_t) options.depth) {
 
-        while (next_time < now - 0.004000) {
+        while (next_time < now - 4000000) {
           stats.skips++;
-          next_time += iagen->generate();
+          next_time += group->iagen->generate() * 1000000000;
         }
       }
 
+      if (options.churn && ++churn_issued == options.churn) {
+        disarm_timer();
+        write_state = CLOSING;
+        fence(now);
+        return;
+      }
+
       break;
 
     case WAITING_FOR_TIME:
       if (now < next_time) {
-        if (!event_pending(timer, EV_TIMEOUT, NULL)) {
+        if (!timer_pending()) {
           delay = next_time - now;
-          double_to_tv(delay, &tv);
-          evtimer_add(timer, &tv);
+          arm_timer(now, delay);
         }
+        fence(now);
         return;
       }
 
@@ -594,15 +903,42 @@ void Connection::drive_write_machine(double now) {
       break;
 
     case WAITING_FOR_OPQ:
-      if (op_queue.size() >= (size_t) options.depth) return;
+      if (outstanding() >= (size_t) options.depth) {
+        fence(now);
+        return;
+      }
       write_state = ISSUING;
       break;
 
+    case BACKING_OFF:
+      // --reconnect gave up when the last run ended: try again.
+      if (!timer_pending()) arm_timer(now, reconnect_delay);
+      return;
+
+    case CLOSING:
+    case CONNECTING:
+      return;
+
     default: DIE("Not implemented");
     }
   }
 }
 
+// The error pending on the socket of `bev' (SO_ERROR), or, if libevent
+// has already collected it, as it does for a failed connect, the one it
+// left in errno.
+static const char *socket_error(struct bufferevent *bev) {
+  int err = EVUTIL_SOCKET_ERROR(), pending = 0;
+  socklen_t len = sizeof(pending);
+  evutil_socket_t fd = bufferevent_getfd(bev);
+
+  if (fd >= 0 && !getsockopt(fd, SOL_SOCKET, SO_ERROR, &pending, &len) &&
+      pending)
+    err = pending;
+
+  return evutil_socket_error_to_string(err);
+}
+
 void Connection::bev_callback(short events) {
   //  struct timeval now_tv;
   // event_base_gettimeofday_cached(base, &now_tv);
@@ -610,6 +946,13 @@ void Connection::bev_callback(short events) {
   if (events & BEV_EVENT_CONNECTED) {
     D("Connected to %s:%s.", hostname.c_str(), port.c_str());
 
+    int64_t now = get_ns();
+    group->connects++;
+    group->connect_sampler.sample((now - connect_start) / 1000.0);
+    if (write_state == CONNECTING)
+      stats.log_connect((now - connect_start) / 1000.0);
+    connect_start = now;  // Now times the SASL handshake.
+
     int fd = bufferevent_getfd(bev);
     if (fd < 0) DIE("bufferevent_getfd");
 
@@ -620,304 +963,218 @@ void Connection::bev_callback(short events) {
         DIE("setsockopt()");
     }
 
-    if (options.sasl)
-      issue_sasl();
-    else
-      read_state = IDLE;  // This is the most important part!
+    if (options.sasl) issue_sasl();
+    else ready();
   } else if (events & BEV_EVENT_ERROR) {
     int err = bufferevent_socket_get_dns_error(bev);
     if (err) DIE("DNS error: %s", evutil_gai_strerror(err));
 
-    DIE("BEV_EVENT_ERROR: %s", strerror(errno));
+    const char *why = socket_error(bev);
+
+    if (read_state == INIT_READ) {
+      connect_failed(why);
+      return;
+    }
+
+    if (options.reconnect && read_state != LOADING) {
+      fault(why);
+      return;
+    }
+
+    DIE("BEV_EVENT_ERROR: %s", why);
   } else if (events & BEV_EVENT_EOF) {
+    if (options.reconnect && read_state != LOADING) {
+      fault("EOF from server");
+      return;
+    }
+
     DIE("Unexpected EOF from server.");
   }
 }
 
 void Connection::read_callback() {
-  struct evbuffer *input;
-  if (options.udp) {
-      // 3. thread barrier: don't release our threads until all agents ready
-    evbuffer_read(read, event_get_fd(ev), 2000);
-    // if (!evbuffer_get_length(read)) return;  // nothing to process
-    // drain the read buffer for now...
-    // TODO: parse returned pseudoheader, organize
-    evbuffer_drain(read, 8);
-    input = read;
-  }
-  else input = bufferevent_get_input(bev);
+  stats.wakeups++;
+  thread_wakeups++;
 
-#if USE_CACHED_TIME
-  struct timeval now_tv;
-  event_base_gettimeofday_cached(base, &now_tv);
-#endif
-
-  char *buf = NULL;
-  Operation *op = NULL;
-  int length;
-  size_t n_read_out;
-
-  double now;
+  if (op_queue.size() == 0 && read_state != LOADING)
+    V("Spurious read callback.");
 
-  // Protocol processing loop.
-
-  if (op_queue.size() == 0) V("Spurious read callback.");
-
-  while (1) {
-    if (op_queue.size() > 0) op = &op_queue.front();
-
-    switch (read_state) {
-    case INIT_READ: DIE("event from uninitialized connection");
-    case IDLE: return;  // We munched all the data we expected?
-
-    // Note: for binary, the whole get suite (GET, GET_DATA, END) is collapsed
-    // into one state
-    case WAITING_FOR_GET:
-      assert(op_queue.size() > 0);
-
-      if (options.binary) {
-        if (consume_binary_response(input)) {
-#if USE_CACHED_TIME
-            now = tv_to_double(&now_tv);
-#else
-            now = get_time();
-#endif
-#if HAVE_CLOCK_GETTIME
-            op->end_time = get_time_accurate();
-#else
-            op->end_time = now;
-#endif
-            stats.log_get(*op);
-
-            last_rx = now;
-            pop_op();
-            drive_write_machine(now);
-            break;
-        } else {
-          return;
-        }
-      }
-
-      buf = evbuffer_readln(input, &n_read_out, EVBUFFER_EOL_CRLF);
-      if (buf == NULL) return;  // A whole line not received yet. Punt.
-
-      stats.rx_bytes += n_read_out; // strlen(buf);
-
-      if (!strcmp(buf, "END")) {
-        //        D("GET (%s) miss.", op->key.c_str());
-        stats.get_misses++;
-
-#if USE_CACHED_TIME
-        now = tv_to_double(&now_tv);
-#else
-        now = get_time();
-#endif
-#if HAVE_CLOCK_GETTIME
-        op->end_time = get_time_accurate();
-#else
-        op->end_time = now;
-#endif
-
-        stats.log_get(*op);
-
-        free(buf);
-
-        last_rx = now;
-        pop_op();
-        drive_write_machine();
-        break;
-      } else if (!strncmp(buf, "VALUE", 5)) {
-        sscanf(buf, "VALUE %*s %*d %d", &length);
-
-        // FIXME: check key name to see if it corresponds to the op at
-        // the head of the op queue?  This will be necessary to
-        // support "gets" where there may be misses.
-
-        data_length = length;
-        read_state = WAITING_FOR_GET_DATA;
-      }
-
-      free(buf);
-
-    case WAITING_FOR_GET_DATA:
-      assert(op_queue.size() > 0);
-
-      length = evbuffer_get_length(input);
-
-      if (length >= data_length + 2) {
-        // FIXME: Actually parse the value?  Right now we just drain it.
+  (this->*receive)();
+}
 
-        /*
-        unsigned char* buffer = evbuffer_pullup(input, valuesize->generate());
-        int index = atoi(key) % (1024 * 1024);
-      //    issue_set(key, &random_char[index], options.valuesize, now);
-      issue_set(key, &random_char[index], valuesize->generate(), now);
-      */
+// Wire format P: chosen once, by the constructor.
+template <class P>
+void Connection::use() {
+  if (group->protocol == NULL) group->protocol = new P(options);
+  send = &Connection::send_request<P>;
+  receive = &Connection::read_responses<P>;
+}
 
+template <class P>
+int Connection::send_request(const wire_request_t &req) {
+  P *p = static_cast<P *>(group->protocol);
 
+  if (!P::datagram) return p->encode_request(bufferevent_get_output(bev), req);
 
-        evbuffer_drain(input, data_length + 2);
-        read_state = WAITING_FOR_END;
+  int l = p->encode_request(write, req);
+  evbuffer_write(write, event_get_fd(ev));
+  return l;
+}
 
-        stats.rx_bytes += data_length + 2;
-      } else {
-        return;
-      }
+// Protocol processing loop.
+template <class P>
+void Connection::read_responses() {
+  P *p = static_cast<P *>(group->protocol);
+  struct evbuffer *input;
 
-    case WAITING_FOR_DELETE:
-      assert(op_queue.size() > 0);
-      pop_op();
-      drive_write_machine();
-      return;
+  if (P::datagram) {
+    evbuffer_read(read, event_get_fd(ev), 2000);
+    p->unframe(read);
+    input = read;
+  } else {
+    input = bufferevent_get_input(bev);
+  }
 
-    case WAITING_FOR_END:
-      assert(op_queue.size() > 0);
+  while (1) {
+    if (read_state == INIT_READ) DIE("event from uninitialized connection");
+    if (read_state == IDLE) return;  // We munched all the data we expected?
 
-      buf = evbuffer_readln(input, &n_read_out, EVBUFFER_EOL_CRLF);
-      if (buf == NULL) return; // Haven't received a whole line yet. Punt.
+    wire_response_t r;
+    size_t n = p->try_decode_response(input, op_queue.size() > 0 ?
+                                      &op_queue.front() : NULL, &r);
+    if (n == 0) return;  // Not all received yet.  Punt.
 
-      stats.rx_bytes += n_read_out;
+    stats.rx_bytes += n;
+    if (r.not_my_vbucket) stats.not_my_vbucket++;
 
-      if (!strcmp(buf, "END")) {
-#if USE_CACHED_TIME
-        now = tv_to_double(&now_tv);
-#else
-        now = get_time();
-#endif
-#if HAVE_CLOCK_GETTIME
-        op->end_time = get_time_accurate();
-#else
-        op->end_time = now;
-#endif
+    if (r.partial) {  // --multiget: a hit, in request order.
+      if (r.hit) match_key(r.key, r.keylen);
+      evbuffer_drain(input, n);
+      continue;
+    }
 
-        stats.log_get(*op);
+    evbuffer_drain(input, n);
 
-        free(buf);
+    switch (read_state) {
+    case WAITING_FOR_RESPONSE: answer(r); break;
+    case LOADING: loaded(r); break;
 
-        last_rx = now;
-        pop_op();
-        drive_write_machine(now);
-        break;
-      } else {
-        DIE("Unexpected result when waiting for END");
-      }
+    case WAITING_FOR_SASL:
+      assert(options.binary);
+      if (r.failed) DIE("SASL authentication failed");
+      V("SASL authentication succeeded");
+      if (write_state == CONNECTING)
+        stats.log_sasl((get_ns() - connect_start) / 1000.0);
+      ready();
+      break;
 
-    case WAITING_FOR_SET:
-      assert(op_queue.size() > 0);
+    default: DIE("not implemented");
+    }
+  }
+}
 
-      if (options.binary) {
-        if (!consume_binary_response(input)) return;
-      } else {
-        buf = evbuffer_readln(input, &n_read_out, EVBUFFER_EOL_CRLF);
-        if (buf == NULL) return; // Haven't received a whole line yet. Punt.
-        stats.rx_bytes += n_read_out;
-      }
+// A response to the request in front, or to a later one when the ones
+// before it were quiet or lost.
+void Connection::answer(const wire_response_t &r) {
+  assert(op_queue.size() > 0);
 
-      now = get_time();
+  int64_t now = get_ns();
+  uint32_t opaque = op_queue.front().opaque;  // ASCII answers in order.
 
-#if HAVE_CLOCK_GETTIME
-      op->end_time = get_time_accurate();
-#else
-      op->end_time = now;
-#endif
+  if (r.has_opaque) opaque = r.opaque;
+  else if (r.fence) opaque = fence_opaque;  // --meta: MN.
 
-      stats.log_set(*op);
+  if (!match_opaque(opaque, now)) return;
 
-      if (!options.binary)
-        free(buf);
+  Operation &op = op_queue.front();
 
-      last_rx = now;
-      pop_op();
-      drive_write_machine(now);
-      break;
+  // NOT_MY_VBUCKET is counted apart; any other failed GET is a miss.
+  if (op.keys) finish_multiget();
+  else if (op.type == Operation::GET && !r.hit && !r.not_my_vbucket)
+    stats.get_misses++;
 
-    case LOADING:
-      assert(op_queue.size() > 0);
+  finish_op(now);
+}
 
-      if (options.binary) {
-        if (!consume_binary_response(input)) return;
-      } else {
-        buf = evbuffer_readln(input, NULL, EVBUFFER_EOL_CRLF);
-        if (buf == NULL) return; // Haven't received a whole line yet.
-        free(buf);
-      }
+// A response while loading.
+void Connection::loaded(const wire_response_t &r) {
+  if (options.measure_load) {
+    assert(op_queue.size() > 0);
+    int64_t now = get_ns();
+    Operation &op = op_queue.front();
 
-      loader_completed++;
-      pop_op();
+    op.end_time = now;
+    stats.log_set(op);
+    op_queue.pop();
 
-      if (loader_completed == options.records) {
-        D("Finished loading.");
-        read_state = IDLE;
-      } else {
-        // printf("issued: %d; completed: %d\n", loader_issued, loader_completed);
-        while (loader_issued < loader_completed + options.loader_chunk) {
-          if (loader_issued >= options.records) break;
-
-          if (!(loader_issued % options.loader_chunk)) usleep(options.rate_delay);
-
-          char key[256];
-          string keystr = keygen->generate(loader_issued);
-          strcpy(key, keystr.c_str());
-          // int index = lrand48() % (1024 * 1024);
-          int index = atoi(key) % (1024 * 1024);
-          //          generate_key(loader_issued, options.keysize, key);
-          //          issue_set(key, &random_char[index], options.valuesize);
-          issue_set(key, &random_char[index], valuesize->generate());
-
-          loader_issued++;
-        }
-      }
+    if (r.failed) loader_errors++;
+    loader_completed++;
 
-      break;
+    size_t second = (now - loader_start) / 1000000000;
+    if (loader_timeline.size() <= second)
+      loader_timeline.resize(second + 1, 0);
+    loader_timeline[second]++;
 
-    case WAITING_FOR_SASL:
-      assert(options.binary);
-      if (!consume_binary_response(input)) return;
-      read_state = IDLE;
-      break;
+    fill_loader();
+    return;
+  }
 
-    default: DIE("not implemented");
-    }
+  // Quiet sets only answer on failure; the reply to the fence at the
+  // end of each chunk acknowledges the whole chunk.
+  if (!r.fence) {
+    loader_errors++;
+    return;
   }
+
+  assert(loader_inflight > 0);
+  loader_completed += loader_chunks[loader_head];
+  loader_head = (loader_head + 1) % LOADER_WINDOW;
+  loader_inflight--;
+  fill_loader();
 }
 
 /**
- * Tries to consume a binary response (in its entirety) from an evbuffer.
+ * Brings the request a response with this opaque answers to the front
+ * of op_queue.  Requests sent before it are done: with --quiet_ops, the
+ * ones that were not answered succeeded (or missed); otherwise their
+ * answers were dropped.
  *
- * @param input evBuffer to read response from
- * @return  true if consumed, false if not enough data in buffer
+ * @return  false if nothing in flight matches: a late or reordered
+ *          response
  */
-bool Connection::consume_binary_response(evbuffer *input) {
-  // Read the first 24 bytes as a header
-  int length = evbuffer_get_length(input);
-  if (length < 24) return false;
-  binary_header_t* h =
-          reinterpret_cast<binary_header_t*>(evbuffer_pullup(input, 24));
-  assert(h);
-
-  // Not whole response
-  int targetLen = 24 + ntohl(h->body_len);
-  if (length < targetLen) {
-    return false;
+bool Connection::match_opaque(uint32_t opaque, int64_t now) {
+  while (op_queue.size() > 0 &&
+         (int32_t) (opaque - op_queue.front().opaque) > 0) {
+    Operation &op = op_queue.front();
+
+    if (options.quiet_ops && op.type != Operation::NOOP) {
+      if (op.type == Operation::GET) stats.get_misses++;
+      op.end_time = now;
+      if (op.type != Operation::DELETE) log_latency(op);
+      pop_op();
+    } else {
+      stats.dropped++;
+      pop_op(false);
+    }
   }
 
-  // if something other than success, count it as a miss
-  if (h->opcode == CMD_GET && h->status) {
-      stats.get_misses++;
- } 
+  if (op_queue.size() > 0 && op_queue.front().opaque == opaque) return true;
 
-  #define unlikely(x) __builtin_expect((x),0)
-  if (unlikely(h->opcode == CMD_SASL)) {
-    if (h->status == RESP_OK) {
-      V("SASL authentication succeeded");
-    } else {;
-      DIE("SASL authentication failed");
-    }
-  }
+  stats.reordered++;
+  return false;
+}
 
-  evbuffer_drain(input, targetLen);
-  stats.rx_bytes += targetLen;
-  return true;
+// The request at the front of op_queue is answered.
+void Connection::finish_op(int64_t now) {
+  Operation &op = op_queue.front();
+
+  op.end_time = now;
+  if (op.type == Operation::GET || op.type == Operation::SET)
+    log_latency(op);
+
+  last_rx = now;
+  pop_op();
+  drive_write_machine(now);
 }
 
 void Connection::udp_callback(short events) {
@@ -933,16 +1190,13 @@ void Connection::udp_callback(short events) {
 
   if (events & EV_READ) read_callback();
 
-  if (events & EV_TIMEOUT && loader_completed != loader_issued) {
-    V("issued: %d; completed: %d", loader_issued, loader_completed);
-    loader_completed = loader_issued;   // HAKCERY
-    // event_remove_timer(ev);
-    // because the above^ line is deprecated?
-    event_del(ev);      // ^ should just remove timer...
-    event_add(ev, NULL);
-    // for (unsigned int i = 0; i < op_queue.size(); i++) op_queue.pop(); 
-    drain_op_queue();
-    read_state = IDLE;
+  // A lost fence would stall the load forever: give up on the chunks
+  // in flight and carry on with the rest.
+  if (events & EV_TIMEOUT && read_state == LOADING &&
+      loader_inflight > 0) {
+    V("UDP load timed out with %d chunks in flight.", loader_inflight);
+    loader_inflight = 0;
+    fill_loader();
   }
 
   /* UDP connections must fire the read callback manually - 
@@ -950,7 +1204,37 @@ void Connection::udp_callback(short events) {
 }
 
 void Connection::write_callback() {}
-void Connection::timer_callback() { drive_write_machine(); }
+void Connection::timer_callback() {
+  int64_t now = get_ns();
+
+  stats.wakeups++;
+  thread_wakeups++;
+
+  if (read_state == LOADING) {  // --rate_delay between loader chunks.
+    fill_loader();
+    return;
+  }
+
+  if (write_state == CLOSING) {
+    churn();
+    return;
+  }
+
+  if (write_state == BACKING_OFF) {
+    // The run ended while down: stay down until the next one.
+    if (run->expired) leave_run();
+    else {
+      write_state = CONNECTING;
+      start_connect();
+    }
+    return;
+  }
+
+  if (write_state == WAITING_FOR_TIME && now >= next_time)
+    stats.log_timer((now - next_time) / 1000000000.0);
+
+  drive_write_machine(now);
+}
 
 // The follow are C trampolines for libevent callbacks.
 void bev_event_cb(struct bufferevent *bev, short events, void *ptr) {
@@ -978,47 +1262,161 @@ void timer_cb(evutil_socket_t fd, short events, void *ptr) {
   conn->timer_callback();
 }
 
+void wheel_cb(void *ptr) {
+  Connection* conn = (Connection*) ptr;
+  conn->timer_callback();
+}
+
 void Connection::set_priority(int pri) {
   if (bufferevent_priority_set(bev, pri))
     DIE("bufferevent_set_priority(bev, %d) failed", pri);
 }
 
-void Connection::start_loading() {
+void Connection::start_loading(load_cursor_t *cursor) {
   read_state = LOADING;
-  loader_issued = loader_completed = 0;
+  loader_cursor = cursor;
+  loader_completed = loader_bytes = loader_errors = 0;
+  loader_next = loader_end = 0;
+  loader_start = get_ns();
+  loader_timeline.clear();
+
+  fill_loader();
+}
+
+// Claim the next --loader_chunk records of this server, if any are
+// left.  With --rate_delay, the next claim waits for the timer.
+bool Connection::claim_loader_chunk() {
+  int64_t first = __atomic_fetch_add(&loader_cursor->next,
+                                     (int64_t) options.loader_chunk,
+                                     __ATOMIC_RELAXED);
+  if (first >= options.records) return false;
+
+  loader_next = first;
+  loader_end = first + options.loader_chunk;
+  if (loader_end > options.records) loader_end = options.records;
+
+  if (options.rate_delay)
+    arm_timer(get_ns(), options.rate_delay * 1000LL);
 
-  for (int i = 0; i < options.loader_chunk; i++) {
-    if (loader_issued >= options.records) break;
+  return true;
+}
+
+// Claim and send chunks until LOADER_WINDOW are in flight, or until
+// --rate_delay holds the next one back.  Leaves the run once the
+// cursor is exhausted and every chunk has been acknowledged.
+void Connection::fill_loader() {
+  if (options.measure_load) {
+    fill_measured_loader();
+    return;
+  }
+
+  while (loader_inflight < LOADER_WINDOW && !timer_pending()) {
+    if (!claim_loader_chunk()) break;
+    int64_t sent = 0;
+
+    for (; loader_next < loader_end; loader_next++) {
+      int s = owner(loader_next);
+      if (s >= 0 && s != server) continue;
+
+      char key[256];
+      int length;
+      record_key(loader_next, key);
+      const char *value = record_value(loader_next, key, &length);
+      issue_load_set(key, loader_next, value, length);
+      sent++;
+    }
+
+    issue_load_fence();
+    loader_chunks[(loader_head + loader_inflight++) % LOADER_WINDOW] = sent;
+  }
+
+  if (loader_inflight == 0 && !timer_pending()) finish_loading();
+}
 
-    // if (options.udp) {                // optimized out?
-    //   usleep(options.rate_delay);
-    //   event_base_loop(base, EVLOOP_NONBLOCK);
-    // }
+// --measure_load: ordinary sets, timed like the run phase's and
+// pipelined up to --depth per connection.
+void Connection::fill_measured_loader() {
+  int64_t now = get_ns();
+
+  while (op_queue.size() < (size_t) options.depth) {
+    if (loader_next == loader_end &&
+        (timer_pending() || !claim_loader_chunk()))
+      break;
+
+    int s = owner(loader_next);
+    if (s >= 0 && s != server) {
+      loader_next++;
+      continue;
+    }
 
     char key[256];
-    // int index = lrand48() % (1024 * 1024);
-    int index = atoi(key) % (1024 * 1024);
-    // printf("loader_issued: %d; random_char[%d]\n", loader_issued, index);
-    string keystr = keygen->generate(loader_issued);
-    strcpy(key, keystr.c_str());
+    int length;
+    record_key(loader_next, key);
+    const char *value = record_value(loader_next, key, &length);
+    issue_set(key, loader_next++, value, length, now);
+  }
 
-    
-          //    generate_key(loader_issued, options.keysize, key);
-    //    issue_set(key, &random_char[index], options.valuesize);
-    issue_set(key, &random_char[index], valuesize->generate());
-    loader_issued++;
+  if (op_queue.size() == 0 && loader_next == loader_end && !timer_pending())
+    finish_loading();
+}
+
+void Connection::record_key(int64_t i, char *key) {
+  if (dataset) {
+    dataset->key(i, key);
+  } else {
+    string keystr = group->keygen->generate(i);
+    strcpy(key, keystr.c_str());
   }
 }
 
+const char *Connection::record_value(int64_t i, const char *key,
+                                     int *length) {
+  if (dataset) return dataset->value(i, length);
+
+  *length = group->valuesize->generate();
+  return &random_char[atoi(key) % (1024 * 1024)];
+}
+
+void Connection::finish_loading() {
+  D("Finished loading.");
+  read_state = IDLE;
+  leave_run();
+}
+
+// A set that is only answered on failure: binary SETQ, ASCII noreply,
+// --meta q.  Not tracked in op_queue.
+void Connection::issue_load_set(const char* key, int64_t record,
+                                const char* value, int length) {
+  wire_request_t req = {};
+  req.type = Operation::SET;
+  req.key = key;
+  req.keylen = strlen(key);
+  req.value = value;
+  req.length = length;
+  req.vbucket = vbucket(record);
+  req.quiet = true;
+
+  loader_bytes += (this->*send)(req);
+}
+
+// Ends a chunk with a request that is always answered.
+void Connection::issue_load_fence() {
+  wire_request_t req = {};
+  req.type = Operation::NOOP;
+
+  (this->*send)(req);
+}
+
 void Connection::drain_op_queue() {
+  batch_keys.clear();
+  batch_next = batch_hits = 0;
+  unfenced = 0;
+
   unsigned int size = op_queue.size();
   for (unsigned int i = 0; i < size; i++) {
+    Connection *issuer = op_queue.front().issuer;
+    release(op_queue.front(), false);
     op_queue.pop();
+    if (issuer) issuer->drive_write_machine();
   }
 }
-
-void Connection::note_absent_keys() {
-  for (int i = 0; i < options.records; i++) {
-    absentKeys.push(i);
-  } 
-}
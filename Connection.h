@@ -1,14 +1,15 @@
 // -*- c++-mode -*-
 
+#include <deque>
 #include <queue>
 #include <string>
-#include <unordered_set>
 
 #include <event2/bufferevent.h>
 #include <event2/dns.h>
 #include <event2/event.h>
 #include <event2/util.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "AdaptiveSampler.h"
@@ -16,7 +17,13 @@
 #include "ConnectionOptions.h"
 #include "ConnectionStats.h"
 #include "Generator.h"
+#include "Hedger.h"
+#include "KeyBitmap.h"
+#include "LogHistogramSampler.h"
 #include "Operation.h"
+#include "Protocol.h"
+#include "RunController.h"
+#include "TimingWheel.h"
 #include "util.h"
 
 using namespace std;
@@ -26,29 +33,92 @@ void bev_read_cb(struct bufferevent *bev, void *ptr);
 void bev_write_cb(struct bufferevent *bev, void *ptr);
 void udp_event_cb(evutil_socket_t fd, short what, void *ptr);
 void timer_cb(evutil_socket_t fd, short what, void *ptr);
+void wheel_cb(void *ptr);
+
+// Callbacks run by the calling thread's event loop so far.  Lets the
+// loop tell idle iterations from busy ones without asking every
+// Connection.
+extern __thread uint64_t thread_wakeups;
+
+// Chunks of quiet sets each Connection keeps in flight while loading.
+#define LOADER_WINDOW 2
+
+// Tries before a Connection gives up connecting.
+#define CONNECT_ATTEMPTS 3
+
+// --reconnect: wait between reconnect attempts, doubling from MIN to
+// MAX (ns).
+#define RECONNECT_BACKOFF_MIN 1000000LL
+#define RECONNECT_BACKOFF_MAX 1000000000LL
+
+// --source_addr: local addresses to bind TCP Connections to, handed
+// out round-robin across all threads.
+struct source_addrs_t {
+  std::vector<struct sockaddr_storage> addrs;
+  std::vector<int> lens;
+  unsigned int next;
+};
+
+// Next record to load from one server.  Every Connection to that
+// server, in every thread and --procs process, claims --loader_chunk
+// records at a time from it, so the load is split across all of them.
+struct load_cursor_t {
+  int64_t next;
+} __attribute__ ((aligned (64)));
+
+class Connection;
+
+// What all Connections of one thread share, and only that thread
+// touches: options, generators, --ratio key state and statistics.
+// Keeping it out of Connection leaves each one little more than its
+// protocol state and socket, so that a thread can hold tens of
+// thousands of them.
+struct conn_group_t {
+  options_t options;
+  ConnectionStats stats;
+  // --ratio: the records in each server, or, with --ketama or
+  // --vbuckets, one bitmap for all of them.  Empty without --ratio.
+  vector<KeyBitmap*> key_state;
+  source_addrs_t *sources;  // --source_addr, or NULL.
+  Hedger *hedger;           // --hedge, or NULL.
+  Protocol *protocol;       // Wire format, made by the first Connection.
+
+  // The thread's Connections, by index of server in its server list.
+  vector<vector<Connection*> > pools;
+
+  // Connection setup, for the connect report.
+  uint64_t connects, connect_failures;
+  LogHistogramSampler connect_sampler;  // us
+
+  Generator *valuesize;
+  Generator *keysize;
+  KeyGenerator *keygen;
+  Generator *iagen;
+  Generator *churngen;  // --churn_rate: gaps between reopens, or NULL.
+
+  conn_group_t(const options_t &options, bool sampling);
+  ~conn_group_t();
+
+  // Change the per-connection request rate.  Takes effect from the
+  // next inter-arrival gap each Connection draws.
+  void set_lambda(double lambda);
+
+  void reset_stats();  // Keeps stats.window.
+};
 
 class Connection {
 public:
   Connection(struct event_base* _base, struct evdns_base* _evdns,
-             string _hostname, string _port, options_t options,
-             bool sampling = true);
+             string _hostname, string _port, conn_group_t* _group,
+             RunController* _run, TimingWheel* _wheel);
   ~Connection();
 
-  string hostname;
-  string port;
-
-  double start_time;  // Time when this connection began operations.
-
   enum read_state_enum {
     INIT_READ,
     LOADING,
     IDLE,
     WAITING_FOR_SASL,
-    WAITING_FOR_GET,
-    WAITING_FOR_GET_DATA,
-    WAITING_FOR_END,
-    WAITING_FOR_SET,
-    WAITING_FOR_DELETE,
+    WAITING_FOR_RESPONSE,
     MAX_READ_STATE,
   };
 
@@ -57,25 +127,28 @@ public:
     ISSUING,
     WAITING_FOR_TIME,
     WAITING_FOR_OPQ,
+    CLOSING,     // --churn: sent the last request of this connection.
+    CONNECTING,  // --churn, --reconnect: reopening.
+    BACKING_OFF, // --reconnect: waiting to reopen.
     MAX_WRITE_STATE,
   };
 
-  read_state_enum read_state;
-  write_state_enum write_state;
+  void issue_get(const char* key, int64_t record, int64_t now = 0,
+                 request_t *request = NULL);
+  void issue_set(const char* key, int64_t record, const char* value,
+                 int length, int64_t now = 0);
+  void issue_delete(const char *key, int64_t record, int64_t now = 0);
+  void issue_multiget(int64_t now);
 
-  ConnectionStats stats;
+  void issue_something(int64_t now = 0);
+  void pop_op(bool answered = true);
+  bool check_exit_condition();
+  void drive_write_machine(int64_t now = 0);
 
-  void issue_get(const char* key, double now = 0.0);
-  void issue_set(const char* key, const char* value, int length,
-                 double now = 0.0);
-  void issue_delete(const char *key, double now = 0.0);
+  void join_run();
+  void leave_run();
 
-  void issue_something(double now = 0.0);
-  void pop_op();
-  bool check_exit_condition(double now = 0.0);
-  void drive_write_machine(double now = 0.0);
-
-  void start_loading();
+  void start_loading(load_cursor_t *cursor);
   void drive_rate_control();
 
   void reset();
@@ -86,35 +159,128 @@ public:
   void write_callback();
   void udp_callback(short events);
   void timer_callback();
-  bool consume_binary_response(evbuffer *input);
+  void answer(const wire_response_t &r);
+  void loaded(const wire_response_t &r);
+  bool match_opaque(uint32_t opaque, int64_t now);
+  void finish_op(int64_t now);
 
   void set_priority(int pri);
 
-  void note_absent_keys();
   void drain_op_queue();
 
-  options_t options;
+  void check_timeout(int64_t now);
+  void hedge(request_t *r, int64_t now);
+  void issue_fanout(int64_t now);
+  Connection *route(int64_t record);
+  void hand_off(Connection *conn);
+  uint16_t vbucket(int64_t record);
+
+private:
+  template <class P> void use();
+  template <class P> int send_request(const wire_request_t &req);
+  template <class P> void read_responses();
+
+  int issue(Operation::type_enum type, wire_request_t &req, int64_t now,
+            request_t *request = NULL);
+
+  void start_connect();
+  void connect_failed(const char *why);
+  void ready();
+
+  void churn();
+  void log_latency(Operation &op);
+  void finish_request(Operation &op, bool answered);
+
+  size_t outstanding() const {
+    return op_queue.size() - routed_in + routed_out - fences;
+  }
+
+  void release(Operation &op, bool answered);
+
+  void match_key(const char *key, int length);
+  void finish_multiget();
+
+  void fence(int64_t now);
+
+  void fault(const char *why);
+  void backoff();
+
+  void arm_timer(int64_t now, int64_t delay);
+  bool timer_pending();
+  void disarm_timer();
+
+  bool claim_loader_chunk();
+  void fill_loader();
+  void fill_measured_loader();
+  void finish_loading();
+  void issue_load_set(const char* key, int64_t record, const char* value,
+                      int length);
+  void issue_load_fence();
+
+  // Record i: from the --load_file Dataset, or synthesized.
+  void record_key(int64_t i, char *key);
+  const char *record_value(int64_t i, const char *key, int *length);
+
+  // Data members.  What issuing and answering a request touches comes
+  // first, packed into as few cache lines as possible; the state of
+  // connection setup, --churn, --reconnect and loading comes after it.
+
+public:
+  read_state_enum read_state;
+  write_state_enum write_state;
+
+  conn_group_t *group;
+  ConnectionStats &stats;    // group->stats
+  const options_t &options;  // group->options
+
+  int server;  // Index of the server in the thread's server list.
+  int slot;    // Index in group->pools[server].
 
   std::queue<Operation> op_queue;
 
 private:
-  struct event_base *base;
-  struct evdns_base *evdns;
+  // The send and receive paths, instantiated for the wire format by
+  // use().
+  int (Connection::*send)(const wire_request_t &req);
+  void (Connection::*receive)();
+
   struct bufferevent *bev;
 
-  struct event *ev;       // UDP only
-  struct evbuffer *read;  // UDP only
-  struct evbuffer *write; // UDP only
-  char udpHdr[8];         // UDP only
-  struct timeval timeout; // UDP only
+  uint32_t seq;  // Opaque of the next request.
+  int fences;    // --quiet_ops: NOOPs in op_queue.
+  int unfenced;  // --quiet_ops: requests sent since the last NOOP.
+  uint32_t fence_opaque;  // --meta: of the NOOP in flight.
+
+  // --ketama: Operations other Connections routed here, and ones this
+  // Connection routed elsewhere.  --depth counts the requests a
+  // Connection issued, wherever they went.
+  int routed_in, routed_out;
 
+  int churn_issued;    // Requests sent since (re)connecting.
+  bool fresh;          // Reopened, first response not in yet.
+
+  RunController *run;
+  unsigned int run_generation;  // Phase joined, or 0 if not in one.
+
+  TimingWheel *wheel;       // --wheel: replaces timer.
   struct event *timer;  // Used to control inter-transmission time.
+                        // NULL with a wheel.
+
   //  double lambda;
-  double next_time; // Inter-transmission time parameters.
-  double last_rx; // Used to moderate transmission rate.
-  double last_tx;
+  int64_t next_time; // Inter-transmission time parameters (get_ns()).
+  int64_t last_rx; // Used to moderate transmission rate.
+  int64_t last_tx;
+
+  wheel_entry_t wheel_node;
+
+  struct event *ev;       // UDP only
+  struct evbuffer *read;  // UDP only
+  struct evbuffer *write; // UDP only
 
-  int data_length;  // When waiting for data, how much we're peeking for.
+  // --multiget: the keys of the batches in op_queue, in order, and how
+  // far the answers to the first batch have got through its keys.
+  std::deque<std::string> batch_keys;
+  int batch_next, batch_hits;
 
   // for --ratio.  keeps track of operations issued.
   // s - set; g - get; d - delete
@@ -124,17 +290,36 @@ private:
     int sa, slss, slds,
       ga, gl, da, dl;
   } ratioStats;
-  int loader_issued, loader_completed;
-  
-  typedef key_t uint_t;
-  std::queue<key_t> absentKeys;
-  std::unordered_set<key_t> loadedKeys;
+
+public:
+  string hostname;
+  string port;
+
+  double start_time;  // Time when this connection began operations.
+
+  int64_t loader_completed;  // Records acknowledged.
+  int64_t loader_bytes;      // Bytes of sets sent.
+  int64_t loader_errors;     // Failed sets.
+  vector<uint64_t> loader_timeline;  // --measure_load: sets per second.
+
+private:
+  struct event_base *base;
+  struct evdns_base *evdns;
+
+  int64_t connect_start;  // get_ns()
+  int connect_attempts;
+
+  int64_t next_churn;  // --churn_rate: earliest reopen (get_ns()).
+  int64_t reconnect_delay;  // --reconnect: current backoff (ns), or 0.
+
+  struct timeval timeout; // UDP only
+
+  load_cursor_t *loader_cursor;
+  int64_t loader_chunks[LOADER_WINDOW];  // Records per fenced chunk,
+  int loader_head, loader_inflight;      // a ring.
+  int64_t loader_next, loader_end;    // Claimed records not yet sent.
+  int64_t loader_start;
 
   // Parameters to tack progress of second-stage operations
   // int post_load_issued;
-
-  Generator *valuesize;
-  Generator *keysize;
-  KeyGenerator *keygen;
-  Generator *iagen;
 };
\ No newline at end of file
@@ -12,6 +12,8 @@ typedef struct {
   int records;
 
   bool binary;
+  bool meta;            // Meta text protocol: mg, ms, md, mn.
+  char meta_flags[32];  // Of every mg.
   bool sasl;
   char username[32];
   char password[32];
@@ -33,16 +35,21 @@ typedef struct {
   double update;
   int time;
   bool loadonly;
+  bool measure_load;
   int loader_chunk;
   int rate_delay;
   int depth;
   bool no_nodelay;
   bool noload;
   int threads;
+  int procs;
   enum distribution_t iadist;
   int warmup;
   bool skip;
 
+  int64_t wheel_slot;  // ns; 0 = one evtimer per Connection.
+  int64_t wheel_spin;
+
   bool roundrobin;
   int server_given;
   int lambda_denom;
@@ -50,6 +57,16 @@ typedef struct {
   bool oob_thread;
 
   bool moderate;
+
+  int churn;          // Requests per connection before reopening; 0 = off.
+  double churn_rate;  // Reopens per second, all connections; 0 = no cap.
+
+  bool reconnect;
+  int64_t timeout;  // ns; 0 = none.
+
+  int fanout;  // Servers each GET request spans; 0 = off.
+  int multiget;  // Keys batched in each GET; 0 = plain gets.
+  bool quiet_ops;  // Quiet gets, sets and deletes, fenced by NOOPs.
 } options_t;
 
 #endif // CONNECTIONOPTIONS_H
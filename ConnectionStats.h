@@ -10,11 +10,12 @@
 #include "AdaptiveSampler.h"
 #elif defined(USE_HISTOGRAM_SAMPLER)
 #include "HistogramSampler.h"
-#else
-#include "LogHistogramSampler.h"
 #endif
 #include "AgentStats.h"
+#include "LogHistogramSampler.h"
+#include "mutilate.h"
 #include "Operation.h"
+#include "QpsController.h"
 
 using namespace std;
 
@@ -28,8 +29,14 @@ class ConnectionStats {
 #else
    get_sampler(200), set_sampler(200), op_sampler(100),
 #endif
+   connect_sampler(200), sasl_sampler(200), fresh_sampler(200),
    rx_bytes(0), tx_bytes(0), gets(0), sets(0),
-   get_misses(0), skips(0), sampling(_sampling) {}
+   get_misses(0), get_keys(0), skips(0), churned(0), timeouts(0),
+   reconnects(0), failed_ops(0), timeline_start(0), request_sampler(200),
+   requests(0), hedges(0), hedge_wins(0), not_my_vbucket(0), dropped(0),
+   reordered(0), loop_iterations(0), wakeups(0), timer_fires(0),
+   timer_lateness_sum(0.0), timer_lateness_max(0.0), busy_time(0.0),
+   busy_max(0.0), client_time(0.0), sampling(_sampling), window(NULL) {}
 
 #ifdef USE_ADAPTIVE_SAMPLER
   AdaptiveSampler<Operation> get_sampler;
@@ -45,22 +52,134 @@ class ConnectionStats {
   LogHistogramSampler op_sampler;
 #endif
 
+  // --churn: setup of the Connections reopened during the run, and the
+  // first request each of them sent.  us.
+  LogHistogramSampler connect_sampler;
+  LogHistogramSampler sasl_sampler;
+  LogHistogramSampler fresh_sampler;
+
   uint64_t rx_bytes, tx_bytes;
   uint64_t gets, sets, get_misses;
+  uint64_t get_keys;  // --multiget: keys the gets asked for.
   uint64_t skips;
+  uint64_t churned;  // Connections reopened.
+
+  // --reconnect.  A timeout or a lost connection fails every request
+  // in flight on it.
+  uint64_t timeouts, reconnects, failed_ops;
+
+  // --reconnect: for each second of the run, the latency of the
+  // requests that completed in it and the faults (lost connections,
+  // failed reconnect attempts and failed requests) that happened in it.
+  int64_t timeline_start;  // get_ns(); 0 = no timeline.
+  vector<LogHistogramSampler> timeline;
+  vector<uint64_t> timeline_faults;
+
+  // --hedge: latency of logical requests, from the first copy to the
+  // first response; duplicates sent, and how often one answered first.
+  LogHistogramSampler request_sampler;
+  uint64_t requests, hedges, hedge_wins;
+
+  // --fanout: latency to the slowest of the first k parts of each
+  // request, k = 1..fanout.
+  vector<LogHistogramSampler> fanout_samplers;
+
+  vector<uint64_t> server_ops;  // --ketama, --vbuckets: by each server.
+  uint64_t not_my_vbucket;      // --vbuckets: NOT_MY_VBUCKET responses.
+
+  // Binary responses matched to requests by opaque: missing ones (a
+  // later request was answered first) and ones that matched nothing in
+  // flight (late, duplicated or reordered).
+  uint64_t dropped, reordered;
+
+  // Client-side instrumentation.  wakeups and timer_* are counted by
+  // each Connection; the rest is filled in per thread by do_mutilate().
+  uint64_t loop_iterations;  // event_base_loop() calls.
+  uint64_t wakeups;          // Read and timer callbacks.
+  uint64_t timer_fires;
+  double timer_lateness_sum, timer_lateness_max;  // Fire time - next_time.
+  double busy_time;   // Seconds a thread spent doing work.
+  double busy_max;    // Highest busy fraction of any single thread.
+  double client_time; // Seconds of thread time, busy or not.
 
   double start, stop;
 
   bool sampling;
+  qps_window_t *window;  // --slo: the thread's current window, or NULL.
+
+  void log_get(Operation& op) {
+    if (sampling) get_sampler.sample(op);
+    gets++;
+    if (window) { window->sampler.sample(op.time()); window->ops++; }
+    if (timeline_start) timeline[second(op.end_time)].sample(op.time());
+  }
+
+  void log_set(Operation& op) {
+    if (sampling) set_sampler.sample(op);
+    sets++;
+    if (window) window->ops++;
+    if (timeline_start) timeline[second(op.end_time)].sample(op.time());
+  }
+
+  void log_fault(int64_t now, uint64_t n = 1) {
+    if (timeline_start) timeline_faults[second(now)] += n;
+  }
+
+  // Index of the timeline second `now' falls in.
+  size_t second(int64_t now) {
+    size_t s = now > timeline_start ? (now - timeline_start) / 1000000000 : 0;
+    if (s >= timeline.size()) {
+      timeline.resize(s + 1, LogHistogramSampler(200));
+      timeline_faults.resize(s + 1, 0);
+    }
+    return s;
+  }
 
-  void log_get(Operation& op) { if (sampling) get_sampler.sample(op); gets++; }
-  void log_set(Operation& op) { if (sampling) set_sampler.sample(op); sets++; }
   void log_op (double op)     { if (sampling)  op_sampler.sample(op); }
 
+  void log_connect(double us) { if (sampling) connect_sampler.sample(us); }
+  void log_sasl(double us)    { if (sampling) sasl_sampler.sample(us); }
+  void log_fresh(Operation& op) {
+    if (sampling) fresh_sampler.sample(op.time());
+  }
+  void log_request(double us) { if (sampling) request_sampler.sample(us); }
+  void log_server(size_t s) {
+    if (server_ops.size() <= s) server_ops.resize(s + 1, 0);
+    server_ops[s]++;
+  }
+
+  void log_fanout(size_t k, double us) {
+    if (!sampling) return;
+    if (fanout_samplers.size() < k)
+      fanout_samplers.resize(k, LogHistogramSampler(200));
+    fanout_samplers[k - 1].sample(us);
+  }
+
   double get_qps() {
     return (gets + sets) / (stop - start);
   }
 
+  void log_timer(double lateness) {
+    timer_fires++;
+    timer_lateness_sum += lateness;
+    if (lateness > timer_lateness_max) timer_lateness_max = lateness;
+  }
+
+  double get_utilization() {
+    return client_time > 0.0 ? busy_time / client_time : 0.0;
+  }
+
+  double get_timer_lateness() {
+    return timer_fires ? timer_lateness_sum / timer_fires : 0.0;
+  }
+
+  // A saturated client issues late and timestamps late, so neither
+  // its QPS nor its latency can be trusted.
+  bool client_saturated() {
+    return busy_max > SATURATED_UTILIZATION ||
+      get_timer_lateness() > SATURATED_TIMER_LATENESS;
+  }
+
 #ifdef USE_ADAPTIVE_SAMPLER
   double get_nth(double nth) {
     vector<double> samples;
@@ -98,13 +217,57 @@ class ConnectionStats {
     set_sampler.accumulate(cs.set_sampler);
     op_sampler.accumulate(cs.op_sampler);
 #endif
+    connect_sampler.accumulate(cs.connect_sampler);
+    sasl_sampler.accumulate(cs.sasl_sampler);
+    fresh_sampler.accumulate(cs.fresh_sampler);
+    request_sampler.accumulate(cs.request_sampler);
 
     rx_bytes += cs.rx_bytes;
     tx_bytes += cs.tx_bytes;
     gets += cs.gets;
     sets += cs.sets;
     get_misses += cs.get_misses;
+    get_keys += cs.get_keys;
     skips += cs.skips;
+    churned += cs.churned;
+    timeouts += cs.timeouts;
+    reconnects += cs.reconnects;
+    failed_ops += cs.failed_ops;
+    requests += cs.requests;
+    hedges += cs.hedges;
+    hedge_wins += cs.hedge_wins;
+    not_my_vbucket += cs.not_my_vbucket;
+    dropped += cs.dropped;
+    reordered += cs.reordered;
+
+    if (fanout_samplers.size() < cs.fanout_samplers.size())
+      fanout_samplers.resize(cs.fanout_samplers.size(),
+                             LogHistogramSampler(200));
+    for (size_t k = 0; k < cs.fanout_samplers.size(); k++)
+      fanout_samplers[k].accumulate(cs.fanout_samplers[k]);
+
+    if (server_ops.size() < cs.server_ops.size())
+      server_ops.resize(cs.server_ops.size(), 0);
+    for (size_t s = 0; s < cs.server_ops.size(); s++)
+      server_ops[s] += cs.server_ops[s];
+
+    if (timeline.size() < cs.timeline.size()) {
+      timeline.resize(cs.timeline.size(), LogHistogramSampler(200));
+      timeline_faults.resize(cs.timeline.size(), 0);
+    }
+    for (size_t s = 0; s < cs.timeline.size(); s++) {
+      timeline[s].accumulate(cs.timeline[s]);
+      timeline_faults[s] += cs.timeline_faults[s];
+    }
+
+    loop_iterations += cs.loop_iterations;
+    wakeups += cs.wakeups;
+    timer_fires += cs.timer_fires;
+    timer_lateness_sum += cs.timer_lateness_sum;
+    timer_lateness_max = max(timer_lateness_max, cs.timer_lateness_max);
+    busy_time += cs.busy_time;
+    busy_max = max(busy_max, cs.busy_max);
+    client_time += cs.client_time;
 
     start = cs.start;
     stop = cs.stop;
@@ -116,7 +279,18 @@ class ConnectionStats {
     gets += as.gets;
     sets += as.sets;
     get_misses += as.get_misses;
+    get_keys += as.get_keys;
     skips += as.skips;
+    churned += as.churned;
+
+    loop_iterations += as.loop_iterations;
+    wakeups += as.wakeups;
+    timer_fires += as.timer_fires;
+    timer_lateness_sum += as.timer_lateness_sum;
+    timer_lateness_max = max(timer_lateness_max, as.timer_lateness_max);
+    busy_time += as.busy_time;
+    busy_max = max(busy_max, as.busy_max);
+    client_time += as.client_time;
 
     start = as.start;
     stop = as.stop;
@@ -189,7 +363,8 @@ class ConnectionStats {
 
     if (newline) printf("\n");
   }
-#else
+#endif
+
   void print_stats(const char *tag, LogHistogramSampler &sampler,
                    bool newline = true) {
     if (sampler.total() == 0) {
@@ -207,7 +382,6 @@ class ConnectionStats {
 
     if (newline) printf("\n");
   }
-#endif
 };
 
 #endif // CONNECTIONSTATS_H
@@ -0,0 +1,94 @@
+// -*- c++ -*-
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Dataset.h"
+#include "log.h"
+
+#define RECORD_HEADER 6
+#define MAX_KEY_LENGTH 250
+
+static uint16_t get_u16(const char *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return le16toh(v);
+}
+
+static uint32_t get_u32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+Dataset::Dataset(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) DIE("open(%s) failed: %s", path, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st)) DIE("fstat(%s) failed: %s", path, strerror(errno));
+  length = st.st_size;
+  if (length == 0) DIE("%s is empty", path);
+
+  data = (const char *) mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) DIE("mmap(%s) failed: %s", path, strerror(errno));
+  close(fd);
+
+  // Indexing reads the file front to back; let the kernel read ahead.
+  madvise((void *) data, length, MADV_SEQUENTIAL);
+  madvise((void *) data, length, MADV_WILLNEED);
+
+  size_t off = 0;
+  while (off < length) {
+    if (length - off < RECORD_HEADER)
+      DIE("%s: truncated record header at offset %zu", path, off);
+
+    uint16_t klen = get_u16(data + off);
+    uint32_t vlen = get_u32(data + off + 2);
+
+    if (klen == 0 || klen > MAX_KEY_LENGTH)
+      DIE("%s: bad key length %u at offset %zu", path, klen, off);
+    if (length - off - RECORD_HEADER < (size_t) klen + vlen)
+      DIE("%s: truncated record at offset %zu", path, off);
+
+    const unsigned char *k =
+      (const unsigned char *) data + off + RECORD_HEADER;
+    for (int j = 0; j < klen; j++)
+      if (k[j] <= ' ' || k[j] == 0x7f)
+        DIE("%s: key at offset %zu is not a valid memcached key", path, off);
+
+    offsets.push_back(off);
+    off += RECORD_HEADER + klen + vlen;
+  }
+
+  // The loader walks it in chunks from many connections at once, and
+  // the run phase picks records at random.
+  madvise((void *) data, length, MADV_NORMAL);
+
+  V("%s: %zu records, %zu bytes", path, offsets.size(), length);
+}
+
+Dataset::~Dataset() {
+  munmap((void *) data, length);
+}
+
+void Dataset::key(size_t i, char *key) const {
+  const char *p = data + offsets[i];
+  uint16_t klen = get_u16(p);
+
+  memcpy(key, p + RECORD_HEADER, klen);
+  key[klen] = '\0';
+}
+
+const char *Dataset::value(size_t i, int *length) const {
+  const char *p = data + offsets[i];
+
+  *length = get_u32(p + 2);
+  return p + RECORD_HEADER + get_u16(p);
+}
@@ -0,0 +1,37 @@
+/* -*- c++ -*- */
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <vector>
+
+// A key/value dump file (--load_file), memory-mapped read-only and
+// indexed once so that any record can be found by number.  The file
+// is a sequence of records, each
+//
+//   uint16_t key length, uint32_t value length (both little-endian),
+//   key bytes, value bytes.
+//
+// Keys must be 1..250 bytes without spaces or control characters, as
+// in memcached's text protocol.  Every process shares the mapping.
+class Dataset {
+public:
+  Dataset(const char *path);
+  ~Dataset();
+
+  size_t size() const { return offsets.size(); }
+
+  // Copy the key of record i into key[0..250] and NUL-terminate it.
+  void key(size_t i, char *key) const;
+
+  const char *value(size_t i, int *length) const;
+
+private:
+  const char *data;
+  size_t length;
+  std::vector<uint64_t> offsets;  // Of each record's header.
+};
+
+#endif // DATASET_H
@@ -0,0 +1,85 @@
+// -*- c++ -*-
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "Connection.h"
+#include "Hedger.h"
+#include "log.h"
+#include "util.h"
+
+Hedger::Hedger(struct event_base *_base, const char *spec) :
+  base(_base), nth(0), sampler(200), samples(0)
+{
+  char *end;
+
+  if (spec[0] == 'p') {
+    nth = strtod(spec + 1, &end);
+    if (*end != '\0' || nth <= 0 || nth >= 100)
+      DIE("Invalid --hedge argument: %s", spec);
+    threshold = INFINITY;
+  } else {
+    threshold = strtod(spec, &end);
+    if (*end != '\0' || threshold < 0)
+      DIE("Invalid --hedge argument: %s", spec);
+  }
+
+  timer = evtimer_new(base, timer_cb, this);
+}
+
+Hedger::~Hedger() {
+  event_free(timer);
+}
+
+void Hedger::track(request_t *r) {
+  if (threshold == INFINITY) return;
+
+  r->pending++;  // Until it leaves the queue.
+  queue.push_back(r);
+  if (queue.size() == 1) arm(r->start_time);
+}
+
+void Hedger::sample(double us) {
+  if (nth == 0) return;
+
+  sampler.sample(us);
+  samples++;
+
+  if (samples >= HEDGE_WARMUP && samples % HEDGE_RECOMPUTE == 0)
+    threshold = sampler.get_nth(nth);
+}
+
+void Hedger::arm(int64_t now) {
+  if (queue.size() == 0) return;
+
+  int64_t due = queue.front()->start_time + (int64_t) (threshold * 1000);
+  struct timeval tv;
+
+  ns_to_tv(due > now ? due - now : 0, &tv);
+  evtimer_add(timer, &tv);
+}
+
+// Send the duplicates that are due.  Requests answered in the meantime
+// just leave the queue.
+void Hedger::fire() {
+  int64_t now = get_ns();
+  int64_t wait = threshold * 1000;
+
+  while (queue.size() > 0) {
+    request_t *r = queue.front();
+    if (!r->done && r->start_time + wait > now) break;
+
+    queue.pop_front();
+    if (!r->done) r->replica->hedge(r, now);
+    if (--r->pending == 0) delete r;
+  }
+
+  arm(now);
+}
+
+void Hedger::timer_cb(evutil_socket_t fd, short what, void *ptr) {
+  Hedger *hedger = (Hedger *) ptr;
+
+  thread_wakeups++;
+  hedger->fire();
+}
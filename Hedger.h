@@ -0,0 +1,51 @@
+/* -*- c++ -*- */
+#ifndef HEDGER_H
+#define HEDGER_H
+
+#include <inttypes.h>
+
+#include <deque>
+
+#include <event2/event.h>
+
+#include "LogHistogramSampler.h"
+#include "Operation.h"
+
+// --hedge: when a GET is still unanswered after a threshold, send a
+// duplicate to a replica; the first response answers the request.
+//
+// The threshold is either fixed or a running percentile of the
+// latency of first copies, recomputed every HEDGE_RECOMPUTE samples.
+// Every request of a thread waits against the same threshold, in the
+// order it was issued, so deadlines come due in queue order and a
+// single timer per thread serves them all.
+
+#define HEDGE_WARMUP 100     // First copies timed before hedging by pN.
+#define HEDGE_RECOMPUTE 100
+
+class Hedger {
+public:
+  Hedger(struct event_base *base, const char *spec);
+  ~Hedger();
+
+  double threshold;  // us; INFINITY while there is none yet.
+
+  void track(request_t *r);  // The first copy of r was just sent.
+  void sample(double us);    // A first copy was answered.
+
+private:
+  struct event_base *base;
+  struct event *timer;
+  std::deque<request_t*> queue;
+
+  double nth;  // Percentile to hedge at, or 0 for a fixed threshold.
+  LogHistogramSampler sampler;
+  uint64_t samples;
+
+  void arm(int64_t now);
+  void fire();
+
+  static void timer_cb(evutil_socket_t fd, short what, void *ptr);
+};
+
+#endif // HEDGER_H
@@ -0,0 +1,150 @@
+// -*- c++ -*-
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "Ketama.h"
+#include "log.h"
+
+// MD5 (RFC 1321), for ketama points; not for anything secure.
+
+static const uint32_t md5_k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+  0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+  0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+
+static const int md5_r[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21 };
+
+static void md5_block(uint32_t h[4], const unsigned char *p) {
+  uint32_t w[16];
+  for (int i = 0; i < 16; i++)
+    w[i] = p[i*4] | (p[i*4+1] << 8) | (p[i*4+2] << 16) |
+      ((uint32_t) p[i*4+3] << 24);
+
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t f;
+    int g;
+
+    if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+    else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+    else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) % 16; }
+    else             { f = c ^ (b | ~d);       g = (7 * i) % 16; }
+
+    uint32_t t = d;
+    d = c;
+    c = b;
+    uint32_t x = a + f + md5_k[i] + w[g];
+    b = b + ((x << md5_r[i]) | (x >> (32 - md5_r[i])));
+    a = t;
+  }
+
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+
+void md5(const void *data, size_t length, unsigned char digest[16]) {
+  const unsigned char *p = (const unsigned char *) data;
+  uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  size_t left = length;
+
+  for (; left >= 64; left -= 64, p += 64) md5_block(h, p);
+
+  // Pad with 0x80, zeroes and the length in bits, to whole blocks.
+  unsigned char tail[128];
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, p, left);
+  tail[left] = 0x80;
+
+  size_t blocks = left < 56 ? 1 : 2;
+  uint64_t bits = (uint64_t) length * 8;
+  for (int i = 0; i < 8; i++) tail[blocks * 64 - 8 + i] = bits >> (8 * i);
+
+  for (size_t i = 0; i < blocks; i++) md5_block(h, tail + i * 64);
+
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++) digest[i*4 + j] = h[i] >> (8 * j);
+}
+
+// Point h (0..3) of a digest, as libketama reads it.
+static uint32_t point(const unsigned char *d, int h) {
+  return ((uint32_t) d[3 + h*4] << 24) | (d[2 + h*4] << 16) |
+    (d[1 + h*4] << 8) | d[h*4];
+}
+
+Ketama::Ketama(char **servers, int n, const char *weights) {
+  std::vector<double> w(n, 1.0);
+
+  if (weights) {
+    char *copy = strdup(weights);
+    char *saveptr = NULL;  // For reentrant strtok().
+    int i = 0;
+
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr), i++) {
+      char *end;
+      if (i >= n) DIE("--ketama_weights: more weights than servers");
+      w[i] = strtod(tok, &end);
+      if (*end != '\0' || w[i] <= 0)
+        DIE("Invalid --ketama_weights argument: %s", weights);
+    }
+
+    free(copy);
+    if (i != n) DIE("--ketama_weights: %d weights for %d servers", i, n);
+  }
+
+  double total = 0;
+  for (int i = 0; i < n; i++) total += w[i];
+
+  for (int i = 0; i < n; i++) {
+    float pct = w[i] / total;
+    unsigned int ks = floorf(pct * 40.0 * (float) n);
+
+    for (unsigned int k = 0; k < ks; k++) {
+      char ss[300];
+      unsigned char digest[16];
+
+      snprintf(ss, sizeof(ss), "%s-%u", servers[i], k);
+      md5(ss, strlen(ss), digest);
+
+      for (int h = 0; h < 4; h++) ring.push_back({point(digest, h), i});
+    }
+  }
+
+  if (ring.size() == 0) DIE("--ketama: no points on the ring");
+  std::sort(ring.begin(), ring.end());
+
+  // Each point owns the arc that ends at it.
+  shares.resize(n, 0.0);
+  for (size_t i = 0; i < ring.size(); i++) {
+    uint32_t from = i ? ring[i - 1].hash : ring.back().hash;
+    shares[ring[i].server] += (uint32_t) (ring[i].hash - from) / 4294967296.0;
+  }
+}
+
+int Ketama::lookup(const char *key) const {
+  unsigned char digest[16];
+  md5(key, strlen(key), digest);
+
+  point_t p = { point(digest, 0), 0 };
+  auto i = std::lower_bound(ring.begin(), ring.end(), p);
+  if (i == ring.end()) i = ring.begin();
+
+  return i->server;
+}
@@ -0,0 +1,41 @@
+/* -*- c++ -*- */
+#ifndef KETAMA_H
+#define KETAMA_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <vector>
+
+// --ketama: libketama-compatible consistent hashing of one keyspace
+// onto the server list.  Server i gets floor(40 * n * w_i / sum(w))
+// MD5 digests of "<server>-<k>", and four points on the ring from
+// each; a key belongs to the server of the first point at or after
+// the first four bytes of its own MD5, wrapping around.
+//
+// Hashing every request would cost an MD5 each, so main() hashes each
+// record once up front and the Connections look up its owner.
+class Ketama {
+public:
+  Ketama(char **servers, int n, const char *weights);
+
+  int lookup(const char *key) const;
+
+  std::vector<uint16_t> owners;  // Server of each record.
+  int owner(int64_t record) const { return owners[record]; }
+
+  std::vector<double> shares;  // Fraction of the ring of each server.
+
+private:
+  struct point_t {
+    uint32_t hash;
+    int server;
+    bool operator<(const point_t &p) const { return hash < p.hash; }
+  };
+
+  std::vector<point_t> ring;
+};
+
+void md5(const void *data, size_t length, unsigned char digest[16]);
+
+#endif // KETAMA_H
@@ -0,0 +1,105 @@
+// -*- c++ -*-
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "KeyBitmap.h"
+
+#define BLOCK_WORDS 8
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+
+KeyBitmap::KeyBitmap(size_t _n) : n(_n), ones(0) {
+  blocks = (n + BLOCK_BITS - 1) / BLOCK_BITS;
+  words.assign(blocks * BLOCK_WORDS, 0);
+  tree.assign(blocks + 1, 0);
+}
+
+void KeyBitmap::add(size_t block, int delta) {
+  for (size_t i = block + 1; i <= blocks; i += i & -i) tree[i] += delta;
+}
+
+void KeyBitmap::set(size_t i) {
+  uint64_t bit = 1ULL << (i % 64);
+  if (words[i / 64] & bit) return;
+
+  words[i / 64] |= bit;
+  ones++;
+  add(i / BLOCK_BITS, 1);
+}
+
+void KeyBitmap::clear(size_t i) {
+  uint64_t bit = 1ULL << (i % 64);
+  if (!(words[i / 64] & bit)) return;
+
+  words[i / 64] &= ~bit;
+  ones--;
+  add(i / BLOCK_BITS, -1);
+}
+
+void KeyBitmap::fill() {
+  for (size_t w = 0; w < words.size(); w++) {
+    size_t first = w * 64;
+    if (first + 64 <= n) words[w] = ~0ULL;
+    else if (first < n) words[w] = (1ULL << (n - first)) - 1;
+    else words[w] = 0;
+  }
+
+  // Build the tree in place: every node passes its sum to its parent.
+  for (size_t i = 1; i <= blocks; i++) {
+    size_t first = (i - 1) * BLOCK_BITS;
+    tree[i] = first + BLOCK_BITS <= n ? BLOCK_BITS : n - first;
+  }
+  for (size_t i = 1; i <= blocks; i++) {
+    size_t parent = i + (i & -i);
+    if (parent <= blocks) tree[parent] += tree[i];
+  }
+
+  ones = n;
+}
+
+size_t KeyBitmap::select(size_t r, bool value) const {
+  assert(r < (value ? ones : n - ones));
+
+  // Descend the tree to the block holding the r-th match.  Padding
+  // past n only ever adds zeros after the last real one.
+  size_t pos = 0;
+  size_t step = 1;
+  while (step * 2 <= blocks) step *= 2;
+
+  for (; step; step /= 2) {
+    size_t next = pos + step;
+    if (next > blocks) continue;
+
+    size_t c = value ? tree[next] : step * BLOCK_BITS - tree[next];
+    if (c <= r) {
+      pos = next;
+      r -= c;
+    }
+  }
+
+  for (size_t w = pos * BLOCK_WORDS; ; w++) {
+    uint64_t x = value ? words[w] : ~words[w];
+    size_t c = __builtin_popcountll(x);
+
+    if (r < c) {
+      for (; r; r--) x &= x - 1;
+      return w * 64 + __builtin_ctzll(x);
+    }
+    r -= c;
+  }
+}
+
+int64_t KeyBitmap::random(bool value) const {
+  size_t matches = value ? ones : n - ones;
+  if (matches == 0) return -1;
+
+  // Dense: a few probes almost always hit.
+  if (matches * 4 >= n) {
+    for (int i = 0; i < 4; i++) {
+      size_t probe = lrand48() % n;
+      if (test(probe) == value) return probe;
+    }
+  }
+
+  return select(lrand48() % matches, value);
+}
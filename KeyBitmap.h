@@ -0,0 +1,44 @@
+/* -*- c++ -*- */
+#ifndef KEYBITMAP_H
+#define KEYBITMAP_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <vector>
+
+// Which records are in memcached, for --ratio: one bit per record,
+// shared by the Connections of a thread.  A Fenwick tree over blocks
+// of 512 bits counts the set bits, so picking the r-th loaded or
+// absent record (select) and updating a bit both take O(log n), and a
+// uniformly random loaded or absent record is usually found by a
+// couple of probes before falling back to select.
+class KeyBitmap {
+public:
+  KeyBitmap(size_t n);
+
+  size_t size() const { return n; }
+  size_t count() const { return ones; }  // Loaded records.
+
+  bool test(size_t i) const { return (words[i / 64] >> (i % 64)) & 1; }
+  void set(size_t i);
+  void clear(size_t i);
+  void fill();  // Mark every record loaded.
+
+  // Index of the r-th (from 0) record whose bit is `value'.
+  size_t select(size_t r, bool value) const;
+
+  // A uniformly random record whose bit is `value', or -1 if none.
+  int64_t random(bool value) const;
+
+private:
+  size_t n;
+  size_t ones;
+  size_t blocks;
+  std::vector<uint64_t> words;
+  std::vector<uint32_t> tree;  // 1-based Fenwick tree of set bits per block.
+
+  void add(size_t block, int delta);
+};
+
+#endif // KEYBITMAP_H
@@ -0,0 +1,65 @@
+// -*- c++ -*-
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "MetaProtocol.h"
+#include "log.h"
+
+int MetaProtocol::encode_request(struct evbuffer *out,
+                                 const wire_request_t &req) {
+  const char *q = req.quiet ? " q" : "";
+  int l;
+
+  switch (req.type) {
+  case Operation::GET:
+    return evbuffer_add_printf(out, "mg %s%s%s O%u%s\r\n", req.key,
+                               *flags ? " " : "", flags, req.opaque, q);
+
+  case Operation::SET:
+    l = evbuffer_add_printf(out, "ms %s %d O%u%s\r\n", req.key, req.length,
+                            req.opaque, q);
+    evbuffer_add(out, req.value, req.length);
+    evbuffer_add(out, "\r\n", 2);
+    return l + req.length + 2;
+
+  case Operation::DELETE:
+    return evbuffer_add_printf(out, "md %s O%u%s\r\n", req.key, req.opaque, q);
+
+  case Operation::NOOP:
+    evbuffer_add(out, "mn\r\n", 4);
+    return 4;
+
+  default: DIE("Not implemented.");
+  }
+}
+
+size_t MetaProtocol::try_decode_response(struct evbuffer *in,
+                                         const Operation *expect,
+                                         wire_response_t *r) {
+  size_t eol_len;
+  struct evbuffer_ptr eol =
+    evbuffer_search_eol(in, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+  if (eol.pos < 0) return 0;  // A whole line not received yet.
+
+  size_t n = eol.pos + eol_len;
+  char *line = (char *) evbuffer_pullup(in, n);
+
+  if (!strncmp(line, "VA ", 3)) {  // VA <size> <flags>*, then the value.
+    n += atoi(line + 3) + 2;
+    if (evbuffer_get_length(in) < n) return 0;
+  }
+
+  memset(r, 0, sizeof(*r));
+  r->fence = eol.pos == 2 && !strncmp(line, "MN", 2);
+  r->hit = !strncmp(line, "VA", 2) || !strncmp(line, "HD", 2);
+  r->failed = !r->hit && !r->fence;  // EN, NS, NF, EX, or an error.
+
+  char *o = (char *) memmem(line, eol.pos, " O", 2);
+  if (o) {
+    r->has_opaque = true;
+    r->opaque = strtoul(o + 2, NULL, 10);
+  }
+
+  return n;
+}
@@ -0,0 +1,22 @@
+/* -*- c++ -*- */
+#ifndef METAPROTOCOL_H
+#define METAPROTOCOL_H
+
+#include "Protocol.h"
+
+// --meta: the text meta protocol.  Every request carries its opaque in
+// an O flag, which the response echoes, and a quiet one the q flag.
+// MN, the answer to an mn, has no opaque.
+class MetaProtocol final : public Protocol {
+public:
+  MetaProtocol(const options_t &options) : flags(options.meta_flags) {}
+
+  int encode_request(struct evbuffer *out, const wire_request_t &req);
+  size_t try_decode_response(struct evbuffer *in, const Operation *expect,
+                             wire_response_t *r);
+
+private:
+  const char *flags;  // --meta_flags, for mg.
+};
+
+#endif // METAPROTOCOL_H
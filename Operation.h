@@ -2,24 +2,45 @@
 #ifndef OPERATION_H
 #define OPERATION_H
 
+#include <inttypes.h>
+
 #include <string>
+#include <vector>
 
 using namespace std;
 
+class Connection;
+
+// One logical request carried by Operations on several Connections
+// (--hedge, --fanout).  Freed once nothing refers to it any more.
+struct request_t {
+  int64_t start_time;   // get_ns()
+  int64_t record;
+  Connection *replica;  // --hedge: where the duplicate goes.
+  int pending;          // Operations in flight, and Hedger queue entries.
+  bool done;            // Answered.
+  bool hedged;          // A duplicate was sent.
+  bool failed;          // --fanout: a part was lost.
+
+  int origin;                // --fanout: server of the first part.
+  std::vector<int64_t> ends; // --fanout: answer time of each part.
+};
+
 class Operation {
 public:
-  double start_time, end_time;
+  int64_t start_time, end_time;  // get_ns()
+  request_t *request;            // Or NULL.
+  Connection *issuer;            // --ketama: routed here by it, or NULL.
+  int keys;                      // --multiget: keys of the batch, or 0.
+  uint32_t opaque;               // The Connection's sequence number.
 
   enum type_enum {
-    GET, SET, SASL, DELETE
+    GET, SET, SASL, DELETE, NOOP
   };
 
   type_enum type;
 
-  string key;
-  // string value;
-
-  double time() const { return (end_time - start_time) * 1000000; }
+  double time() const { return (end_time - start_time) / 1000.0; }  // us
 };
 
 
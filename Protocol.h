@@ -0,0 +1,69 @@
+/* -*- c++ -*- */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <event2/buffer.h>
+
+#include "ConnectionOptions.h"
+#include "Operation.h"
+
+// One request, in no particular wire format.
+struct wire_request_t {
+  Operation::type_enum type;  // GET, SET, DELETE or NOOP.
+  const char *key;
+  int keylen;
+  const char *value;          // SET only.
+  int length;
+  uint32_t opaque;            // Echoed by binary and --meta responses.
+  uint16_t vbucket;           // Binary only.
+  bool quiet;                 // Only answered on a hit or a failure.
+
+  // --multiget: a GET of these keys instead of key.  ASCII and binary.
+  const char *const *keys;
+  int nkeys;
+};
+
+// One response, decoded.
+struct wire_response_t {
+  bool fence;           // Answers a NOOP.
+  bool hit;             // A GET found its key.
+  bool failed;          // A miss, NOT_STORED, NOT_FOUND, an error...
+  bool not_my_vbucket;
+  bool partial;         // --multiget: one key's answer; more will follow.
+  const char *key;      // Of a partial answer.  Valid until drained.
+  int keylen;
+  bool has_opaque;
+  uint32_t opaque;
+};
+
+// A wire format: how Connection encodes requests and decodes responses.
+// Implementations are final, and Connection's send and receive paths
+// are templates instantiated once per implementation, so that the
+// calls on the hot path are direct and a new protocol touches nothing
+// but its own module and the choice of one in Connection::Connection().
+class Protocol {
+public:
+  virtual ~Protocol() {}
+
+  // Appends `req' to `out'.  Returns its length in bytes.
+  virtual int encode_request(struct evbuffer *out,
+                             const wire_request_t &req) = 0;
+
+  // Decodes the response at the front of `in', given the request in
+  // flight at the front of the queue, or NULL while loading, when only
+  // fences and failures are answered.  Does not drain: returns the
+  // length of the whole response for the caller to drain once done
+  // with `r', or 0 if it has not all arrived yet.
+  virtual size_t try_decode_response(struct evbuffer *in,
+                                     const Operation *expect,
+                                     wire_response_t *r) = 0;
+
+  // UdpFraming hides these.
+  static const bool datagram = false;
+  void unframe(struct evbuffer *in) {}
+};
+
+#endif // PROTOCOL_H
@@ -0,0 +1,158 @@
+// -*- c++ -*-
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "QpsController.h"
+
+#define MIN_GAIN 0.02
+
+// Two-sided 95% Student's t for 1..9 degrees of freedom.
+static const double t95[] = { 12.706, 4.303, 3.182, 2.776, 2.571,
+                              2.447, 2.365, 2.306, 2.262 };
+
+QpsController::QpsController(const char *spec, double _qps, double _window,
+                             int _threads) :
+  window(_window), threads(_threads), arrived(0), qps(_qps), epoch(0),
+  gain(1.0), last_sign(0), flips(0), converged(0), settling(false)
+{
+  char *s_copy = strdup(spec);
+  char *saveptr = NULL;  // For reentrant strtok().
+
+  for (char *tok = strtok_r(s_copy, ",", &saveptr); tok;
+       tok = strtok_r(NULL, ",", &saveptr)) {
+    slo_t slo;
+    char *end;
+
+    slo.nth = strtod(tok, &end);
+    if (*end != ':') DIE("Invalid --slo argument: %s", spec);
+    slo.us = strtod(end + 1, &end);
+    if (*end != '\0' || slo.nth <= 0 || slo.nth >= 100 || slo.us <= 0)
+      DIE("Invalid --slo argument: %s", spec);
+
+    slos.push_back(slo);
+  }
+
+  free(s_copy);
+  if (slos.size() == 0) DIE("Invalid --slo argument: %s", spec);
+
+  pthread_mutex_init(&lock, NULL);
+}
+
+QpsController::~QpsController() {
+  pthread_mutex_destroy(&lock);
+}
+
+void QpsController::contribute(qps_window_t *w) {
+  pthread_mutex_lock(&lock);
+
+  merged.sampler.accumulate(w->sampler);
+  merged.ops += w->ops;
+
+  if (++arrived == threads) {
+    step();
+    merged.clear();
+    arrived = 0;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  w->clear();
+}
+
+bool QpsController::changed(unsigned int *_epoch, double *_qps) {
+  if (__atomic_load_n(&epoch, __ATOMIC_ACQUIRE) == *_epoch) return false;
+
+  pthread_mutex_lock(&lock);
+  *_epoch = epoch;
+  *_qps = qps;
+  pthread_mutex_unlock(&lock);
+
+  return true;
+}
+
+void QpsController::step() {
+  if (settling) {
+    settling = false;
+    return;
+  }
+
+  double achieved = merged.ops / window;
+  double e = log(2.0);  // No samples at all: nothing was slow.
+
+  if (merged.sampler.total() > 0) {
+    for (auto &slo: slos)
+      e = std::min(e, log(slo.us / merged.sampler.get_nth(slo.nth)));
+  }
+
+  // A saturated client, or a --depth limit, holds back the offered
+  // load without latency ever rising.  Don't run away from it.
+  if (achieved < 0.9 * qps)
+    e = std::min(e, achieved > 0.0 ? log(achieved / qps) : -log(2.0));
+
+  e = std::max(-log(2.0), std::min(log(2.0), e));
+
+  bool met = e >= 0.0;
+  history.push_back({qps, achieved, met});
+
+  V("--slo: target %.0f QPS, achieved %.0f, %s (gain %.3f)", qps, achieved,
+    met ? "met" : "missed", gain);
+
+  int sign = met ? 1 : -1;
+  if (last_sign && sign != last_sign) {
+    gain = std::max(gain / 2, MIN_GAIN);
+    if (++flips == 2) converged = history.size() - 1;
+  }
+  last_sign = sign;
+
+  qps *= exp(gain * e);
+  if (qps < 1.0) qps = 1.0;
+
+  __atomic_add_fetch(&epoch, 1, __ATOMIC_RELEASE);
+  settling = true;
+}
+
+void QpsController::report() {
+  size_t n = flips >= 2 ? history.size() - converged : 0;
+
+  if (n < 2) {
+    W("--slo did not converge in %zu windows; run longer (-t).",
+      history.size());
+    printf("SLO QPS   = %.1f (not converged)\n", qps);
+    return;
+  }
+
+  // Consecutive windows are correlated; batch them before estimating
+  // the variance of the mean.
+  size_t batches = std::min(n, (size_t) 10);
+  size_t size = n / batches;
+  size_t first = history.size() - batches * size;
+
+  double sum = 0.0, sum_sq = 0.0, achieved = 0.0;
+
+  for (size_t b = 0; b < batches; b++) {
+    double mean = 0.0;
+
+    for (size_t i = 0; i < size; i++) {
+      mean += history[first + b * size + i].target;
+      achieved += history[first + b * size + i].achieved;
+    }
+
+    mean /= size;
+    sum += mean;
+    sum_sq += mean * mean;
+  }
+
+  double mean = sum / batches;
+  double var = (sum_sq - batches * mean * mean) / (batches - 1);
+  double ci = t95[batches - 2] * sqrt(std::max(var, 0.0) / batches);
+
+  printf("SLO QPS   = %.1f +/- %.1f (95%% CI over %zu windows, "
+         "%.1f achieved)\n", mean, ci, batches * size,
+         achieved / (batches * size));
+}
@@ -0,0 +1,75 @@
+/* -*- c++ -*- */
+#ifndef QPSCONTROLLER_H
+#define QPSCONTROLLER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include "LogHistogramSampler.h"
+
+// Online search for the highest QPS that meets one or more latency
+// SLOs (--slo), in a single run instead of one run per probe.
+//
+// Every thread owns a qps_window_t, which its ConnectionStats feed
+// with GET latencies.  Once per window each thread hands its window to
+// contribute(); when the last thread of the window has done so, the
+// controller compares the merged percentiles with the SLOs and moves
+// the target multiplicatively by exp(gain * e), where e is the log
+// distance to the tightest SLO.  gain halves every time e changes
+// sign, so the target first doubles or halves towards the knee and
+// then settles on it.  Threads pick up a new target by polling
+// changed(), which is a single atomic load.
+//
+// The first window after each change mixes two rates and is not
+// judged.  Windows after the second sign change count towards the
+// reported knee, whose confidence interval comes from batch means.
+
+struct qps_window_t {
+  LogHistogramSampler sampler;  // GET latencies, us.
+  uint64_t ops;                 // GETs and SETs.
+
+  qps_window_t() : sampler(200), ops(0) {}
+  void clear() { sampler = LogHistogramSampler(200); ops = 0; }
+};
+
+class QpsController {
+public:
+  QpsController(const char *spec, double qps, double window, int threads);
+  ~QpsController();
+
+  double window;  // Seconds.
+
+  // Merge and clear a thread's window.
+  void contribute(qps_window_t *w);
+
+  // True, with the new target QPS, if it changed since *epoch.
+  bool changed(unsigned int *epoch, double *qps);
+
+  void report();
+
+private:
+  struct slo_t { double nth, us; };
+  struct step_t { double target, achieved; bool met; };
+
+  std::vector<slo_t> slos;
+  std::vector<step_t> history;
+
+  pthread_mutex_t lock;
+  int threads;
+  int arrived;
+  qps_window_t merged;
+
+  double qps;
+  unsigned int epoch;
+  double gain;
+  int last_sign;
+  int flips;
+  size_t converged;  // First history index after the second sign change.
+  bool settling;
+
+  void step();
+};
+
+#endif // QPSCONTROLLER_H
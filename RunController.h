@@ -0,0 +1,62 @@
+/* -*- c++ -*- */
+#ifndef RUNCONTROLLER_H
+#define RUNCONTROLLER_H
+
+#include <event2/event.h>
+
+#include "util.h"
+
+// Decides when a thread's event loop is done, without the loop having
+// to poll every Connection after each iteration.  Each phase
+// (connect, load, run, drain) begins with begin() or start();
+// Connections that take part join() it and leave() when they are
+// finished.  The loop runs while running().  Timed phases also end
+// when the single deadline timer armed by start() fires.
+
+class RunController {
+public:
+  int active;          // Connections that joined and have not left.
+  bool expired;        // The deadline of the last start() has passed.
+  unsigned int generation;  // Bumped by every begin().
+
+  RunController(struct event_base *_base) :
+    active(0), expired(false), generation(0), base(_base) {
+    deadline = evtimer_new(base, deadline_cb, this);
+  }
+
+  ~RunController() { event_free(deadline); }
+
+  void begin() {
+    generation++;
+    active = 0;
+  }
+
+  void start(double duration) {
+    struct timeval tv;
+
+    begin();
+    expired = false;
+    double_to_tv(duration, &tv);
+    evtimer_add(deadline, &tv);
+  }
+
+  void join() { active++; }
+
+  void leave() {
+    if (--active == 0) event_base_loopbreak(base);
+  }
+
+  bool running() { return active > 0 && !expired; }
+
+private:
+  struct event_base *base;
+  struct event *deadline;
+
+  static void deadline_cb(evutil_socket_t fd, short what, void *ptr) {
+    RunController *run = (RunController *) ptr;
+    run->expired = true;
+    event_base_loopbreak(run->base);
+  }
+};
+
+#endif // RUNCONTROLLER_H
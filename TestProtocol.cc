@@ -0,0 +1,210 @@
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include <event2/buffer.h>
+
+#include "AsciiProtocol.h"
+#include "BinaryProtocol.h"
+#include "binary_protocol.h"
+#include "log.h"
+#include "MetaProtocol.h"
+
+// Checks for the Protocol decoders and encoders.  Exits non-zero on the
+// first failure.
+
+#define CHECK(x) do { if (!(x)) DIE("Check failed: %s", #x); } while (0)
+
+static options_t options;
+
+// Feeds `data' to `p' one byte more at a time: every prefix must be
+// incomplete, and the whole must decode to `length' bytes.  Returns the
+// buffer, which r->key points into, for the caller to free.
+static struct evbuffer *decode(Protocol &p, const std::string &data,
+                               size_t length, const Operation *expect,
+                               wire_response_t *r) {
+  struct evbuffer *in = evbuffer_new();
+
+  for (size_t i = 0; i < data.size(); i++) {
+    if (i < length) CHECK(p.try_decode_response(in, expect, r) == 0);
+    evbuffer_add(in, &data[i], 1);
+  }
+
+  CHECK(p.try_decode_response(in, expect, r) == length);
+  return in;
+}
+
+static std::string encode(Protocol &p, const wire_request_t &req) {
+  struct evbuffer *out = evbuffer_new();
+  int l = p.encode_request(out, req);
+
+  std::string s(evbuffer_get_length(out), '\0');
+  evbuffer_remove(out, &s[0], s.size());
+  evbuffer_free(out);
+
+  CHECK(l == (int) s.size());
+  return s;
+}
+
+static std::string binary_response(uint8_t opcode, uint16_t status,
+                                   uint32_t opaque, const std::string &key,
+                                   const std::string &value) {
+  int extras = opcode == CMD_NOOP ? 0 : 4;
+  binary_header_t h = { 0x81, opcode, htons(key.size()),
+                        (uint8_t) extras, 0x00, {htons(status)},
+                        htonl(extras + key.size() + value.size()), opaque };
+
+  return std::string((char *) &h, 24) + std::string(extras, '\0') + key +
+    value;
+}
+
+static void test_ascii() {
+  AsciiProtocol p(options);
+  Operation get, multiget;
+  wire_response_t r;
+  struct evbuffer *in;
+
+  get.type = multiget.type = Operation::GET;
+  get.keys = 0;
+  multiget.keys = 2;
+
+  // A hit is only whole with its END.
+  std::string hit = "VALUE foo 0 5\r\nhello\r\nEND\r\n";
+  in = decode(p, hit, hit.size(), &get, &r);
+  CHECK(r.hit && !r.failed && !r.partial);
+  evbuffer_free(in);
+
+  in = decode(p, "END\r\n", 5, &get, &r);
+  CHECK(!r.hit && r.failed);
+  evbuffer_free(in);
+
+  // --multiget: each VALUE is a partial answer, END the last.
+  std::string value = "VALUE bar 0 3\r\nabc\r\n";
+  in = decode(p, value + "END\r\n", value.size(), &multiget, &r);
+  CHECK(r.partial && r.hit && r.keylen == 3 && !memcmp(r.key, "bar", 3));
+  evbuffer_drain(in, value.size());
+  CHECK(p.try_decode_response(in, &multiget, &r) == 5);
+  CHECK(!r.partial && !r.failed);
+  evbuffer_free(in);
+
+  in = decode(p, "STORED\r\n", 8, NULL, &r);
+  CHECK(!r.failed && !r.fence);
+  evbuffer_free(in);
+
+  in = decode(p, "NOT_STORED\r\n", 12, NULL, &r);
+  CHECK(r.failed);
+  evbuffer_free(in);
+
+  in = decode(p, "VERSION 1.6.0\r\n", 15, NULL, &r);
+  CHECK(r.fence && !r.failed);
+  evbuffer_free(in);
+
+  wire_request_t req = {};
+  req.type = Operation::SET;
+  req.key = "k";
+  req.keylen = 1;
+  req.value = "vv";
+  req.length = 2;
+  req.quiet = true;
+  CHECK(encode(p, req) == "set k 0 0 2 noreply\r\nvv\r\n");
+
+  const char *keys[] = { "a", "b" };
+  req = wire_request_t();
+  req.type = Operation::GET;
+  req.keys = keys;
+  req.nkeys = 2;
+  CHECK(encode(p, req) == "get a b\r\n");
+}
+
+static void test_binary() {
+  BinaryProtocol p(options);
+  wire_response_t r;
+  struct evbuffer *in;
+
+  std::string hit = binary_response(CMD_GET, RESP_OK, 7, "", "hello");
+  in = decode(p, hit, hit.size(), NULL, &r);
+  CHECK(r.hit && !r.failed && !r.partial && r.has_opaque && r.opaque == 7);
+  evbuffer_free(in);
+
+  std::string miss = binary_response(CMD_GET, 0x01, 8, "", "");
+  in = decode(p, miss, miss.size(), NULL, &r);
+  CHECK(!r.hit && r.failed && !r.not_my_vbucket);
+  evbuffer_free(in);
+
+  std::string nmv = binary_response(CMD_GET, RESP_NOT_MY_VBUCKET, 9, "", "");
+  in = decode(p, nmv, nmv.size(), NULL, &r);
+  CHECK(r.failed && r.not_my_vbucket);
+  evbuffer_free(in);
+
+  // --multiget: GETKQ hits carry their key.
+  std::string getkq = binary_response(CMD_GETKQ, RESP_OK, 0, "key", "v");
+  in = decode(p, getkq, getkq.size(), NULL, &r);
+  CHECK(r.partial && r.hit && r.keylen == 3 && !memcmp(r.key, "key", 3));
+  evbuffer_free(in);
+
+  std::string noop = binary_response(CMD_NOOP, RESP_OK, 10, "", "");
+  in = decode(p, noop, noop.size(), NULL, &r);
+  CHECK(r.fence && !r.failed && r.opaque == 10);
+  evbuffer_free(in);
+
+  wire_request_t req = {};
+  req.type = Operation::GET;
+  req.key = "key";
+  req.keylen = 3;
+  req.opaque = 5;
+  req.quiet = true;
+  std::string s = encode(p, req);
+  CHECK(s.size() == 27 && (uint8_t) s[1] == CMD_GETQ && s.substr(24) == "key");
+}
+
+static void test_meta() {
+  strcpy(options.meta_flags, "v");
+  MetaProtocol p(options);
+  wire_response_t r;
+  struct evbuffer *in;
+
+  // The value can arrive after its VA line.
+  std::string va = "VA 5 O7\r\nhello\r\n";
+  in = decode(p, va, va.size(), NULL, &r);
+  CHECK(r.hit && !r.failed && r.has_opaque && r.opaque == 7);
+  evbuffer_free(in);
+
+  in = decode(p, "EN O3\r\n", 7, NULL, &r);
+  CHECK(!r.hit && r.failed && r.opaque == 3);
+  evbuffer_free(in);
+
+  in = decode(p, "HD O4\r\n", 7, NULL, &r);
+  CHECK(r.hit && !r.failed);
+  evbuffer_free(in);
+
+  // MN has no opaque.
+  in = decode(p, "MN\r\n", 4, NULL, &r);
+  CHECK(r.fence && !r.failed && !r.has_opaque);
+  evbuffer_free(in);
+
+  in = decode(p, "SERVER_ERROR out of memory\r\n", 28, NULL, &r);
+  CHECK(r.failed && !r.has_opaque);
+  evbuffer_free(in);
+
+  wire_request_t req = {};
+  req.type = Operation::GET;
+  req.key = "k";
+  req.keylen = 1;
+  req.opaque = 12;
+  req.quiet = true;
+  CHECK(encode(p, req) == "mg k v O12 q\r\n");
+}
+
+int main(int argc, char **argv) {
+  test_ascii();
+  test_binary();
+  test_meta();
+
+  printf("All protocol checks passed.\n");
+  return 0;
+}
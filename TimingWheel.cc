@@ -0,0 +1,231 @@
+// -*- c++ -*-
+
+#include <assert.h>
+#include <string.h>
+
+#include "log.h"
+#include "TimingWheel.h"
+#include "util.h"
+
+TimingWheel::TimingWheel(struct event_base *_base, int64_t _slot,
+                         int64_t _spin) :
+  base(_base), dispatching(false), slot(_slot), spin(_spin), cur(0),
+  armed(UINT64_MAX)
+{
+  assert(slot > 0);
+
+  for (int l = 0; l < WHEEL_LEVELS; l++)
+    for (int s = 0; s < WHEEL_SLOTS; s++)
+      slots[l][s].next = slots[l][s].prev = &slots[l][s];
+  memset(bitmap, 0, sizeof(bitmap));
+
+  epoch = get_ns();
+  timer = evtimer_new(base, timer_cb, this);
+}
+
+TimingWheel::~TimingWheel() {
+  event_free(timer);
+}
+
+uint64_t TimingWheel::time_to_tick(int64_t t) const {
+  if (t <= epoch) return 0;
+  return (t - epoch) / slot;
+}
+
+void TimingWheel::schedule(wheel_entry_t *e, int64_t when) {
+  if (e->pending()) unlink(e);
+
+  // Round up, so that an entry never fires before its time.
+  e->tick = when <= epoch ? 0 : (when - epoch + slot - 1) / slot;
+  insert(e);
+
+  if (!dispatching && e->tick < armed) arm();
+}
+
+void TimingWheel::cancel(wheel_entry_t *e) {
+  if (e->pending()) unlink(e);
+}
+
+void TimingWheel::insert(wheel_entry_t *e) {
+  if (e->tick < cur) e->tick = cur;
+
+  uint64_t delta = e->tick - cur;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+    level++;
+
+  int index;
+  if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS))) {
+    // Beyond the wheel: park in the last level-3 slot.
+    index = ((cur >> (WHEEL_BITS * level)) - 1) & (WHEEL_SLOTS - 1);
+  } else {
+    index = (e->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  }
+
+  wheel_entry_t *head = &slots[level][index];
+  e->next = head->next;
+  e->prev = head;
+  head->next->prev = e;
+  head->next = e;
+  bitmap[level][index / 64] |= 1ULL << (index % 64);
+}
+
+void TimingWheel::unlink(wheel_entry_t *e) {
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+
+  // If the slot is now empty, e->next and e->prev are both its head.
+  if (e->next == e->prev) {
+    wheel_entry_t *head = e->next;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+      if (head >= slots[l] && head < slots[l] + WHEEL_SLOTS) {
+        int index = head - slots[l];
+        bitmap[l][index / 64] &= ~(1ULL << (index % 64));
+        break;
+      }
+    }
+  }
+
+  e->next = e->prev = NULL;
+}
+
+// Move the entries of the current slot of `level' down a level.
+void TimingWheel::cascade(int level) {
+  int index = (cur >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  wheel_entry_t *head = &slots[level][index];
+
+  wheel_entry_t list;
+  if (head->next == head) return;
+
+  // Detach the whole slot first: entries may land back in it.
+  list.next = head->next;
+  list.prev = head->prev;
+  list.next->prev = &list;
+  list.prev->next = &list;
+  head->next = head->prev = head;
+  bitmap[level][index / 64] &= ~(1ULL << (index % 64));
+
+  while (list.next != &list) {
+    wheel_entry_t *e = list.next;
+    list.next = e->next;
+    e->next->prev = &list;
+    insert(e);
+  }
+}
+
+// Ring distance from `start' to the first non-empty slot of `level',
+// or -1 if the level is empty.
+static int find_slot(const uint64_t *bits, int start) {
+  for (int d = 0; d < WHEEL_SLOTS; ) {
+    int index = (start + d) & (WHEEL_SLOTS - 1);
+    uint64_t word = bits[index / 64] >> (index % 64);
+    if (word) return d + __builtin_ctzll(word);
+    d += 64 - index % 64;
+  }
+  return -1;
+}
+
+void TimingWheel::advance(uint64_t now_tick) {
+  while (cur <= now_tick) {
+    if ((cur & (WHEEL_SLOTS - 1)) == 0) {
+      for (int l = WHEEL_LEVELS - 1; l > 0; l--)
+        if ((cur & ((1ULL << (WHEEL_BITS * l)) - 1)) == 0) cascade(l);
+    }
+
+    int index = cur & (WHEEL_SLOTS - 1);
+    wheel_entry_t *head = &slots[0][index];
+
+    if (head->next == head) {
+      // Skip ahead to the next non-empty slot or the end of this block.
+      int d = find_slot(bitmap[0], index);
+      uint64_t next = (cur | (WHEEL_SLOTS - 1)) + 1;
+      if (d >= 0 && index + d < WHEEL_SLOTS) next = cur + d;
+      cur = next < now_tick + 1 ? next : now_tick + 1;
+      continue;
+    }
+
+    // Detach the slot before firing it: a callback that reschedules
+    // a full turn ahead lands back in the same slot.
+    wheel_entry_t list;
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->next = head->prev = head;
+    bitmap[0][index / 64] &= ~(1ULL << (index % 64));
+
+    // Callbacks that reschedule for "now" land in the next tick.
+    cur++;
+
+    while (list.next != &list) {
+      wheel_entry_t *e = list.next;
+      unlink(e);
+      e->cb(e->arg);
+    }
+  }
+}
+
+bool TimingWheel::next_tick(uint64_t *tick) {
+  uint64_t best = UINT64_MAX;
+
+  int d = find_slot(bitmap[0], cur & (WHEEL_SLOTS - 1));
+  if (d >= 0) best = cur + d;
+
+  // Higher levels hold later blocks; wake up when the first one
+  // cascades.  If cur sits on a block boundary that block has not
+  // cascaded yet, so it is still ahead of us.
+  for (int l = 1; l < WHEEL_LEVELS; l++) {
+    uint64_t block = cur >> (WHEEL_BITS * l);
+    if (cur & ((1ULL << (WHEEL_BITS * l)) - 1)) block++;
+
+    int d = find_slot(bitmap[l], block & (WHEEL_SLOTS - 1));
+    if (d < 0) continue;
+
+    uint64_t t = (block + d) << (WHEEL_BITS * l);
+    if (t < best) best = t;
+  }
+
+  *tick = best;
+  return best != UINT64_MAX;
+}
+
+void TimingWheel::arm() {
+  uint64_t tick;
+
+  if (!next_tick(&tick)) {
+    evtimer_del(timer);
+    armed = UINT64_MAX;
+    return;
+  }
+
+  struct timeval tv;
+  ns_to_tv(tick_to_time(tick) - get_ns() - spin, &tv);
+  evtimer_add(timer, &tv);
+  armed = tick;
+}
+
+void TimingWheel::dispatch() {
+  dispatching = true;
+
+  while (1) {
+    int64_t now = get_ns();
+    advance(time_to_tick(now));
+
+    uint64_t tick;
+    if (!next_tick(&tick)) break;
+
+    int64_t when = tick_to_time(tick);
+    if (when - now > spin) break;
+
+    while (get_ns() < when) ;  // Spin out the last few microseconds.
+  }
+
+  dispatching = false;
+  arm();
+}
+
+void TimingWheel::timer_cb(evutil_socket_t fd, short what, void *ptr) {
+  TimingWheel *wheel = (TimingWheel *) ptr;
+  wheel->dispatch();
+}
@@ -0,0 +1,75 @@
+/* -*- c++ -*- */
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <inttypes.h>
+
+#include <event2/event.h>
+
+// Hierarchical timing wheel that paces all Connections of a thread
+// from one libevent timer, instead of one evtimer (and one min-heap
+// operation) per Connection per inter-arrival gap.
+//
+// Time is divided into ticks of `slot' nanoseconds.  Four levels of 256
+// slots cover 2^32 ticks; entries further out are parked in the last
+// level-3 slot and re-examined when it cascades.  Each dispatch
+// advances the wheel to the current tick and fires every due entry,
+// then arms the thread's timer for the next non-empty slot.  With
+// spin > 0 the timer is armed `spin' nanoseconds early and the remainder
+// is busy-waited, trading CPU for pacing precision.
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+typedef void (*wheel_cb_t)(void *arg);
+
+struct wheel_entry_t {
+  wheel_entry_t *next, *prev;  // prev == NULL when not scheduled.
+  uint64_t tick;
+  wheel_cb_t cb;
+  void *arg;
+
+  wheel_entry_t() : next(NULL), prev(NULL), tick(0), cb(NULL), arg(NULL) {}
+  bool pending() const { return prev != NULL; }
+};
+
+class TimingWheel {
+public:
+  TimingWheel(struct event_base *base, int64_t slot, int64_t spin = 0);
+  ~TimingWheel();
+
+  // (Re)schedule e to fire at absolute time `when' (get_ns()).
+  void schedule(wheel_entry_t *e, int64_t when);
+  void cancel(wheel_entry_t *e);
+
+  // Fire everything due by now and re-arm the thread's timer.
+  void dispatch();
+
+private:
+  struct event_base *base;
+  struct event *timer;
+  bool dispatching;
+
+  int64_t slot, spin;
+  int64_t epoch;  // Time of tick 0.
+  uint64_t cur;   // Next tick to process; all earlier ticks are done.
+  uint64_t armed; // Tick the timer is armed for, or UINT64_MAX.
+
+  wheel_entry_t slots[WHEEL_LEVELS][WHEEL_SLOTS];  // List heads.
+  uint64_t bitmap[WHEEL_LEVELS][WHEEL_SLOTS / 64];  // Non-empty slots.
+
+  uint64_t time_to_tick(int64_t t) const;
+  int64_t tick_to_time(uint64_t tick) const { return epoch + tick * slot; }
+
+  void insert(wheel_entry_t *e);
+  void unlink(wheel_entry_t *e);
+  void cascade(int level);
+  void advance(uint64_t now_tick);
+  bool next_tick(uint64_t *tick);
+  void arm();
+
+  static void timer_cb(evutil_socket_t fd, short what, void *ptr);
+};
+
+#endif // TIMINGWHEEL_H
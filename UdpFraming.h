@@ -0,0 +1,41 @@
+/* -*- c++ -*- */
+#ifndef UDPFRAMING_H
+#define UDPFRAMING_H
+
+#include <string.h>
+
+#include "Protocol.h"
+
+#define UDP_FRAME_HEADER 8
+
+// --udp: protocol P, one request per datagram.  Each datagram starts
+// with memcached's UDP frame header, which says it is the only one of
+// its message.  Connection sends the datagram once it is encoded, and
+// strips the header from each datagram received.
+template <class P>
+class UdpFraming final : public Protocol {
+public:
+  UdpFraming(const options_t &options) : inner(options) {
+    memset(header, 0, sizeof(header));
+    header[5] = 1;  // want to send only 1 datagram
+  }
+
+  int encode_request(struct evbuffer *out, const wire_request_t &req) {
+    evbuffer_add(out, header, sizeof(header));
+    return sizeof(header) + inner.encode_request(out, req);
+  }
+
+  size_t try_decode_response(struct evbuffer *in, const Operation *expect,
+                             wire_response_t *r) {
+    return inner.try_decode_response(in, expect, r);
+  }
+
+  static const bool datagram = true;
+  void unframe(struct evbuffer *in) { evbuffer_drain(in, sizeof(header)); }
+
+private:
+  P inner;
+  char header[UDP_FRAME_HEADER];
+};
+
+#endif // UDPFRAMING_H
@@ -0,0 +1,68 @@
+// -*- c++ -*-
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "VBucketMap.h"
+
+static uint32_t crc32_table[256];
+
+static void crc32_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crc32_table[i] = c;
+  }
+}
+
+VBucketMap::VBucketMap(int count, const char *file, int n) : mask(count - 1) {
+  if (count < 1 || count > 0x8000 || (count & (count - 1)))
+    DIE("--vbuckets must be a power of two, at most 32768");
+
+  if (crc32_table[1] == 0) crc32_init();
+
+  if (file == NULL) {
+    for (int v = 0; v < count; v++) servers.push_back(v % n);
+    return;
+  }
+
+  // Whitespace-separated server indices, one per vBucket in order.
+  // '#' starts a comment.
+  FILE *f = fopen(file, "r");
+  if (f == NULL) DIE("--vbucket_map: cannot open %s", file);
+
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line;
+
+    while (1) {
+      while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+      if (*p == '\0' || *p == '#') break;
+
+      char *end;
+      long s = strtol(p, &end, 10);
+      if (end == p || s < 0 || s >= n)
+        DIE("--vbucket_map: %s: bad server index near \"%.16s\" "
+            "(want 0..%d)", file, p, n - 1);
+
+      servers.push_back(s);
+      p = end;
+    }
+  }
+
+  fclose(f);
+
+  if (servers.size() != (size_t) count)
+    DIE("--vbucket_map: %s maps %zu vBuckets, --vbuckets is %d", file,
+        servers.size(), count);
+}
+
+uint16_t VBucketMap::vbucket(const char *key, size_t length) const {
+  uint32_t crc = 0xffffffff;
+
+  for (size_t i = 0; i < length; i++)
+    crc = (crc >> 8) ^ crc32_table[(crc ^ (unsigned char) key[i]) & 0xff];
+
+  return ((~crc >> 16) & 0x7fff) & mask;
+}
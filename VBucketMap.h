@@ -0,0 +1,32 @@
+/* -*- c++ -*- */
+#ifndef VBUCKETMAP_H
+#define VBUCKETMAP_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <vector>
+
+// --vbuckets: Couchbase-style routing for the binary protocol.  A key
+// belongs to vBucket (CRC32(key) >> 16 & 0x7fff) & (count - 1), as in
+// libvbucket, and every request carries its vBucket in the header.
+// Each vBucket belongs to one --server: the one --vbucket_map names,
+// or vBucket v to server v % servers.
+//
+// As with --ketama, main() hashes each record once up front and the
+// Connections look up its owner.
+class VBucketMap {
+public:
+  VBucketMap(int count, const char *file, int servers);
+
+  uint16_t vbucket(const char *key, size_t length) const;
+
+  std::vector<uint16_t> servers;  // Server of each vBucket.
+  std::vector<uint16_t> records;  // vBucket of each record.
+  int owner(int64_t record) const { return servers[records[record]]; }
+
+private:
+  uint32_t mask;
+};
+
+#endif // VBUCKETMAP_H
@@ -4,9 +4,15 @@
 #define CMD_GET  0x00
 #define CMD_SET  0x01
 #define CMD_DELETE 0x04
+#define CMD_GETQ 0x09
+#define CMD_NOOP 0x0a
+#define CMD_GETKQ 0x0d
+#define CMD_SETQ 0x11
+#define CMD_DELETEQ 0x14
 #define CMD_SASL 0x21
 
 #define RESP_OK 0x00
+#define RESP_NOT_MY_VBUCKET 0x07
 #define RESP_SASL_ERR 0x20
 
 typedef struct __attribute__ ((__packed__)) {
@@ -1,14 +1,20 @@
 #include <arpa/inet.h>
 #include <assert.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <numeric>
 #include <queue>
 #include <string>
 #include <vector>
@@ -34,9 +40,17 @@
 #include "cmdline.h"
 #include "Connection.h"
 #include "ConnectionOptions.h"
+#include "Dataset.h"
+#include "Ketama.h"
+#include "KeyBitmap.h"
 #include "log.h"
 #include "mutilate.h"
+#include "numa.h"
+#include "QpsController.h"
+#include "RunController.h"
+#include "TimingWheel.h"
 #include "util.h"
+#include "VBucketMap.h"
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
@@ -44,6 +58,9 @@ using namespace std;
 
 gengetopt_args_info args;
 char random_char[2 * 1024 * 1024];  // Buffer used to generate random values.
+Dataset *dataset = NULL;
+Ketama *ketama = NULL;
+VBucketMap *vbuckets = NULL;
 
 #ifdef HAVE_LIBZMQ
 vector<zmq::socket_t*> agent_sockets;
@@ -54,6 +71,7 @@ struct thread_data {
   const vector<string> *servers;
   options_t *options;
   bool master;  // Thread #0, not to be confused with agent master.
+  int numa_node;  // Node to allocate memory on, or -1.
 #ifdef HAVE_LIBZMQ
   zmq::socket_t *socket;
 #endif
@@ -63,6 +81,93 @@ struct thread_data {
 
 pthread_barrier_t barrier;
 
+/*
+ * Local multi-process mode (--procs)
+ *
+ * go() forks options.procs - 1 children at the start of every run.
+ * Process 0 plays the part of the agent master and the children play
+ * the part of agents, but instead of ZMQ messages they share a single
+ * anonymous MAP_SHARED region:
+ *
+ * 1. options_t, written by process 0 before forking.  lambda_denom
+ *    already counts the connections of every process.
+ * 2. A PTHREAD_PROCESS_SHARED barrier, waited on by the master thread
+ *    of each process wherever agents would synchronize.
+ * 3. One AgentStats slot per process, filled in by each child right
+ *    before it exits and accumulated by process 0 in finish_procs().
+ */
+struct procs_shm_t {
+  options_t options;
+  pthread_barrier_t barrier;
+  AgentStats stats[MAXIMUM_PROCS];
+};
+
+procs_shm_t *procs_shm = NULL;
+cpu_set_t procs_cpus;       // CPUs available to all processes.
+int proc_index = 0;         // 0 in the parent, 1..procs-1 in children.
+vector<pid_t> proc_pids;
+
+/*
+ * Partitioned loader
+ *
+ * Every Connection takes part in loading.  They claim --loader_chunk
+ * records at a time from the cursor of their server, which lives,
+ * with the load totals, in an anonymous MAP_SHARED region so that
+ * --procs children share it as well.  go() rewinds it before every
+ * run.  Agents load independently.
+ *
+ * With --measure_load, each thread also adds its Connections' set
+ * latencies and per-second timelines to load_stats and load_timeline.
+ */
+struct loader_shm_t {
+  uint64_t records, bytes, errors;  // Totals for the load report.
+  load_cursor_t cursors[];          // One per entry of loader_servers.
+};
+
+loader_shm_t *loader_shm = NULL;
+size_t loader_shm_size = 0;
+vector<string> loader_servers;
+
+ConnectionStats load_stats;
+vector<uint64_t> load_timeline;
+pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+source_addrs_t source_addrs;  // --source_addr
+
+// Connection setup of this process's threads, for the connect report.
+uint64_t connects, connect_failures;
+LogHistogramSampler connect_sampler(200);  // us
+pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Persistent --scan/--search session
+ *
+ * Without one, every step calls go(), which reconnects and reloads
+ * the whole dataset before measuring.  With one, go() runs once, in
+ * session.thread, and its worker threads keep their Connections.  For
+ * each step main() publishes a new lambda and meets the workers at
+ * two barriers: at `start' they pick up the lambda, run it unmeasured
+ * for --settle seconds, measure, and add their stats to *stats; at
+ * `finish' main() reads the result.  Only local threads take part:
+ * --procs and agent runs fall back to one go() per step.
+ */
+struct session_t {
+  bool active;
+  bool done;          // Set before the last `start' to end the session.
+  double lambda;      // Per-connection rate for the next step.
+  double settle;
+  vector<string> servers;
+  options_t options;
+  ConnectionStats *stats;
+  pthread_mutex_t lock;  // Guards *stats.
+  pthread_barrier_t start, finish;
+  pthread_t thread;
+};
+
+session_t session;
+
+QpsController *qps_controller = NULL;  // --slo
+
 double boot_time;
 
 void init_random_stuff();
@@ -83,6 +188,42 @@ void do_mutilate(const vector<string> &servers, options_t &options,
 void args_to_options(options_t* options);
 void* thread_main(void *arg);
 
+void init_procs(const options_t &options);
+void prep_loader(const vector<string> &servers);
+void print_load_stats(double start, double stop);
+load_cursor_t *loader_cursor(const string &server);
+void session_open(const vector<string> &servers, const options_t &options);
+void session_step(const vector<string> &servers, options_t &options,
+                  ConnectionStats &stats);
+void session_close();
+void auto_curve(const vector<string> &servers, options_t &options);
+void synchronize(bool master, const options_t &options
+#ifdef HAVE_LIBZMQ
+, zmq::socket_t* socket
+#endif
+);
+
+void agent_stats_from(const ConnectionStats &stats, AgentStats &as) {
+  as.rx_bytes = stats.rx_bytes;
+  as.tx_bytes = stats.tx_bytes;
+  as.gets = stats.gets;
+  as.sets = stats.sets;
+  as.get_misses = stats.get_misses;
+  as.get_keys = stats.get_keys;
+  as.start = stats.start;
+  as.stop = stats.stop;
+  as.skips = stats.skips;
+  as.churned = stats.churned;
+  as.loop_iterations = stats.loop_iterations;
+  as.wakeups = stats.wakeups;
+  as.timer_fires = stats.timer_fires;
+  as.timer_lateness_sum = stats.timer_lateness_sum;
+  as.timer_lateness_max = stats.timer_lateness_max;
+  as.busy_time = stats.busy_time;
+  as.busy_max = stats.busy_max;
+  as.client_time = stats.client_time;
+}
+
 #ifdef HAVE_LIBZMQ
 static std::string s_recv (zmq::socket_t &socket) {
   zmq::message_t message;
@@ -111,10 +252,11 @@ static bool s_send (zmq::socket_t &socket, const std::string &string) {
  * However, neither the master nor the agent know at this point how
  * many total connections will be made to the memcached server.
  *
- * 2. Agent -> Master: int num = (--threads) * (--lambda_mul)
+ * 2. Agent -> Master: int num = (--threads) * (--procs) * (--lambda_mul)
  *
  * The agent sends a number to the master indicating how many threads
- * this mutilate agent will spawn, and a mutiplier that weights how
+ * this mutilate agent will spawn (across all of its local processes),
+ * and a mutiplier that weights how
  * many QPS this agent's connections will send relative to unweighted
  * connections (i.e. we can request that a purely load-generating
  * agent or an agent on a really fast network connection be more
@@ -165,7 +307,8 @@ void agent() {
     socket.recv(&request);
 
     zmq::message_t num(sizeof(int));
-    *((int *) num.data()) = args.threads_arg * args.lambda_mul_arg;
+    *((int *) num.data()) =
+      args.threads_arg * args.procs_arg * args.lambda_mul_arg;
     socket.send(num);
 
     options_t options;
@@ -183,6 +326,7 @@ void agent() {
     }
 
     options.threads = args.threads_arg;
+    options.procs = args.procs_arg;
 
     socket.recv(&request);
     options.lambda_denom = *((int *) request.data());
@@ -197,20 +341,14 @@ void agent() {
     //    if (options.threads > 1)
       pthread_barrier_init(&barrier, NULL, options.threads);
 
+    if (options.procs > 1 && procs_shm == NULL) init_procs(options);
+
     ConnectionStats stats;
 
     go(servers, options, stats, &socket);
 
     AgentStats as;
-
-    as.rx_bytes = stats.rx_bytes;
-    as.tx_bytes = stats.tx_bytes;
-    as.gets = stats.gets;
-    as.sets = stats.sets;
-    as.get_misses = stats.get_misses;
-    as.start = stats.start;
-    as.stop = stats.stop;
-    as.skips = stats.skips;
+    agent_stats_from(stats, as);
 
     string req = s_recv(socket);
     //    V("req = %s", req.c_str());
@@ -354,6 +492,585 @@ void sync_agent(zmq::socket_t* socket) {
 }
 #endif
 
+void init_procs(const options_t &options) {
+  procs_shm = (procs_shm_t *) mmap(NULL, sizeof(procs_shm_t),
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (procs_shm == MAP_FAILED) DIE("mmap() failed: %s", strerror(errno));
+
+#ifdef HAVE_PTHREAD_BARRIER_INIT
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  if (pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED))
+    DIE("pthread_barrierattr_setpshared() failed");
+  pthread_barrier_init(&procs_shm->barrier, &attr, options.procs);
+  pthread_barrierattr_destroy(&attr);
+#else
+  DIE("--procs requires process-shared POSIX barriers");
+#endif
+
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &procs_cpus))
+    DIE("sched_getaffinity() failed: %s", strerror(errno));
+}
+
+void prep_loader(const vector<string> &servers) {
+  size_t size = sizeof(loader_shm_t) + servers.size() * sizeof(load_cursor_t);
+
+  if (loader_shm && size != loader_shm_size) {
+    munmap(loader_shm, loader_shm_size);
+    loader_shm = NULL;
+  }
+
+  if (loader_shm == NULL) {
+    loader_shm = (loader_shm_t *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (loader_shm == MAP_FAILED) DIE("mmap() failed: %s", strerror(errno));
+    loader_shm_size = size;
+  }
+
+  memset(loader_shm, 0, size);
+  loader_servers = servers;
+
+  load_stats = ConnectionStats();
+  load_timeline.clear();
+}
+
+void print_load_stats(double start, double stop) {
+  double t = stop - start;
+
+  printf("\n");
+  load_stats.print_header();
+  load_stats.print_stats("load", load_stats.set_sampler);
+
+  printf("\nLoad QPS  = %.1f (%" PRIu64 " / %.2fs), %.1f MB/s out, "
+         "%.1f MB/s in\n", load_stats.sets / t, load_stats.sets, t,
+         load_stats.tx_bytes / t / 1000000, load_stats.rx_bytes / t / 1000000);
+
+  printf("\n%-7s %8s\n", "#second", "sets/s");
+  for (size_t i = 0; i < load_timeline.size(); i++) {
+    double width = std::min(1.0, t - i);  // The last second is partial.
+    printf("%-7zu %8.0f\n", i,
+           width > 0.0 ? load_timeline[i] / width : 0.0);
+  }
+  printf("\n");
+}
+
+// --reconnect: the per-second timeline, and latency before, during and
+// after the seconds that saw faults.
+void print_disruption(ConnectionStats &stats) {
+  vector<LogHistogramSampler> &timeline = stats.timeline;
+  int first = -1, last = -1;
+
+  printf("Timeouts = %" PRIu64 ", reconnects = %" PRIu64 ", "
+         "failed requests = %" PRIu64 "\n\n", stats.timeouts,
+         stats.reconnects, stats.failed_ops);
+
+  printf("%-7s %8s %8s %8s %8s\n", "#second", "ops", "faults", "avg", "99th");
+  for (size_t i = 0; i < timeline.size(); i++) {
+    LogHistogramSampler &s = timeline[i];
+    uint64_t n = s.total();
+
+    if (stats.timeline_faults[i]) {
+      if (first < 0) first = i;
+      last = i;
+    }
+
+    printf("%-7zu %8" PRIu64 " %8" PRIu64 " %8.1f %8.1f\n", i, n,
+           stats.timeline_faults[i], n ? s.average() : 0.0,
+           n ? s.get_nth(99) : 0.0);
+  }
+
+  if (first < 0) {
+    printf("\nNo disruption.\n\n");
+    return;
+  }
+
+  LogHistogramSampler before(200), during(200), after(200);
+  for (int i = 0; i < (int) timeline.size(); i++)
+    (i < first ? before : i <= last ? during : after).accumulate(timeline[i]);
+
+  printf("\nDisruption from second %d to %d:\n", first, last);
+  stats.print_header();
+  stats.print_stats("before", before);
+  stats.print_stats("during", during);
+  stats.print_stats("after", after);
+
+  // Recovery: the first second after the last fault whose 99th is
+  // back within 10% of the 99th before the first one.
+  if (before.total()) {
+    double baseline = before.get_nth(99);
+    size_t i;
+
+    for (i = last + 1; i < timeline.size(); i++)
+      if (timeline[i].total() && timeline[i].get_nth(99) <= 1.1 * baseline)
+        break;
+
+    if (i < timeline.size())
+      printf("\nRecovered to within 10%% of the 99th before the disruption "
+             "%zus after it.\n", i - last);
+    else
+      printf("\nDid not recover to within 10%% of the 99th before the "
+             "disruption.\n");
+  }
+
+  printf("\n");
+}
+
+// --fanout: request latency against the number of servers it spans.
+void print_fanout(ConnectionStats &stats) {
+  printf("%-7s %7s %7s %7s %7s %7s %7s\n", "#fanout", "avg", "50th",
+         "90th", "95th", "99th", "99.9th");
+
+  for (size_t k = 0; k < stats.fanout_samplers.size(); k++) {
+    LogHistogramSampler &s = stats.fanout_samplers[k];
+    if (s.total() == 0) continue;
+
+    printf("%-7zu %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f\n", k + 1,
+           s.average(), s.get_nth(50), s.get_nth(90), s.get_nth(95),
+           s.get_nth(99), s.get_nth(99.9));
+  }
+
+  printf("\n");
+}
+
+// --ketama, --vbuckets: the server (vBucket) of every record, hashed
+// once.
+static void assign_records(const options_t &options) {
+  Generator *keysize = createGenerator(options.keysize);
+  KeyGenerator keygen(keysize, options.records);
+
+  if (ketama) ketama->owners.resize(options.records);
+  else vbuckets->records.resize(options.records);
+
+  for (int i = 0; i < options.records; i++) {
+    char key[256];
+
+    if (dataset) dataset->key(i, key);
+    else strcpy(key, keygen.generate(i).c_str());
+
+    if (ketama) ketama->owners[i] = ketama->lookup(key);
+    else vbuckets->records[i] = vbuckets->vbucket(key, strlen(key));
+  }
+
+  delete keysize;
+}
+
+// --ketama, --vbuckets: how the ring (or the vBuckets), the records
+// and the requests that were answered split across the servers.
+void print_shards(ConnectionStats &stats) {
+  vector<double> shares(args.server_given, 0.0);
+  vector<uint64_t> records(args.server_given, 0);
+  size_t total;
+
+  if (ketama) {
+    shares = ketama->shares;
+    for (auto s: ketama->owners) records[s]++;
+    total = ketama->owners.size();
+  } else {
+    for (auto s: vbuckets->servers)
+      shares[s] += 1.0 / vbuckets->servers.size();
+    for (auto v: vbuckets->records) records[vbuckets->servers[v]]++;
+    total = vbuckets->records.size();
+  }
+
+  uint64_t ops = 0;
+  for (auto n: stats.server_ops) ops += n;
+
+  printf("%-7s %8s %8s %7s  %s\n", "#server", ketama ? "ring" : "vbuckets",
+         "records", "ops", "address");
+
+  for (unsigned int s = 0; s < args.server_given; s++) {
+    uint64_t n = s < stats.server_ops.size() ? stats.server_ops[s] : 0;
+
+    printf("%-7u %7.1f%% %7.1f%% %6.1f%%  %s\n", s, shares[s] * 100,
+           100.0 * records[s] / total, ops ? 100.0 * n / ops : 0.0,
+           args.server_arg[s]);
+  }
+
+  printf("\n");
+
+  if (vbuckets)
+    printf("NOT_MY_VBUCKET = %" PRIu64 " (%.1f%% of responses)\n\n",
+           stats.not_my_vbucket,
+           ops ? 100.0 * stats.not_my_vbucket / ops : 0.0);
+}
+
+load_cursor_t *loader_cursor(const string &server) {
+  for (unsigned int i = 0; i < loader_servers.size(); i++)
+    if (loader_servers[i] == server) return &loader_shm->cursors[i];
+
+  DIE("No loader cursor for %s", server.c_str());
+}
+
+// Give each process an equal, contiguous share of the available CPUs,
+// or with --numa a whole node.  --affinity and --numa then place
+// threads within that share.
+void pin_proc(int index, int procs) {
+  cpu_set_t m;
+  CPU_ZERO(&m);
+
+  if (args.numa_given) {
+    int node = numa_place(index, &procs_cpus, false, &m);
+    numa_bind_memory(node);
+    I("Process %d on NUMA node %d, CPUs %s.", index, node,
+      cpuset_to_string(&m).c_str());
+  } else {
+    int ncpus = CPU_COUNT(&procs_cpus);
+    int share = ncpus / procs > 0 ? ncpus / procs : 1;
+    int first = (index * share) % ncpus;
+
+    int n = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+      if (!CPU_ISSET(c, &procs_cpus)) continue;
+      if (n >= first && n < first + share) CPU_SET(c, &m);
+      n++;
+    }
+
+    V("Process %d pinned to CPUs %s.", index, cpuset_to_string(&m).c_str());
+  }
+
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &m))
+    DIE("sched_setaffinity() failed: %s", strerror(errno));
+}
+
+// Returns in every process: 0 in the parent, the child's index otherwise.
+int prep_procs(options_t& options) {
+  procs_shm->options = options;
+  proc_pids.clear();
+
+  for (int p = 1; p < options.procs; p++) {
+    pid_t pid = fork();
+    if (pid < 0) DIE("fork() failed: %s", strerror(errno));
+
+    if (pid == 0) {
+      proc_index = p;
+      options = procs_shm->options;
+      srand48(time(NULL) ^ getpid());
+      pin_proc(p, options.procs);
+      return p;
+    }
+
+    proc_pids.push_back(pid);
+  }
+
+  pin_proc(0, options.procs);
+  return 0;
+}
+
+void finish_procs(ConnectionStats &stats) {
+  if (proc_index > 0) {
+    agent_stats_from(stats, procs_shm->stats[proc_index]);
+    _exit(0);
+  }
+
+  for (auto pid: proc_pids) {
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+      DIE("waitpid() failed: %s", strerror(errno));
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      DIE("Process %d exited abnormally.", pid);
+  }
+
+  for (unsigned int p = 1; p <= proc_pids.size(); p++)
+    stats.accumulate(procs_shm->stats[p]);
+}
+
+/*
+ * Wait until every thread of every local process (and every agent,
+ * if any) has arrived, then release them all at once.  Only process
+ * 0 talks to agents; the second process barrier keeps the children
+ * from starting before the agents have been released.
+ */
+void synchronize(bool master, const options_t &options
+#ifdef HAVE_LIBZMQ
+, zmq::socket_t* socket
+#endif
+) {
+  bool agents = false;
+#ifdef HAVE_LIBZMQ
+  agents = args.agent_given || args.agentmode_given;
+#endif
+
+  if (!agents && options.procs <= 1) return;
+
+  if (master) V("Synchronizing.");
+
+  // 1. thread barrier: make sure our threads ready before syncing
+  // 2. sync processes and agents: everyone is now ready
+  // 3. thread barrier: don't release our threads until everyone ready
+  pthread_barrier_wait(&barrier);
+  if (master) {
+    if (options.procs > 1) pthread_barrier_wait(&procs_shm->barrier);
+#ifdef HAVE_LIBZMQ
+    if (agents && proc_index == 0) sync_agent(socket);
+#endif
+    if (options.procs > 1) pthread_barrier_wait(&procs_shm->barrier);
+  }
+  pthread_barrier_wait(&barrier);
+
+  if (master) V("Synchronized.");
+}
+
+void* session_main(void *arg) {
+  ConnectionStats stats;  // Steps report through session.stats instead.
+  go(session.servers, session.options, stats);
+  return NULL;
+}
+
+void session_open(const vector<string> &servers, const options_t &options) {
+  if (options.procs > 1 || args.agent_given || options.threads < 1) {
+    V("--procs/--agent: reconnecting and reloading for every step.");
+    return;
+  }
+
+  session.active = true;
+  session.done = false;
+  session.settle = args.settle_arg;
+  session.servers = servers;
+  session.options = options;
+
+  pthread_mutex_init(&session.lock, NULL);
+  pthread_barrier_init(&session.start, NULL, options.threads + 1);
+  pthread_barrier_init(&session.finish, NULL, options.threads + 1);
+
+  if (pthread_create(&session.thread, NULL, session_main, NULL))
+    DIE("pthread_create() failed");
+}
+
+// Measure one --scan/--search step at options.lambda.
+void session_step(const vector<string> &servers, options_t &options,
+                  ConnectionStats &stats) {
+  if (!session.active) {
+    go(servers, options, stats);
+    return;
+  }
+
+  session.lambda = options.lambda;
+  session.stats = &stats;
+
+  pthread_barrier_wait(&session.start);
+  pthread_barrier_wait(&session.finish);
+}
+
+void session_close() {
+  if (!session.active) return;
+
+  session.done = true;
+  pthread_barrier_wait(&session.start);
+
+  if (pthread_join(session.thread, NULL)) DIE("pthread_join() failed");
+
+  pthread_barrier_destroy(&session.start);
+  pthread_barrier_destroy(&session.finish);
+  pthread_mutex_destroy(&session.lock);
+  session.active = false;
+}
+
+/*
+ * Automatic latency-throughput curve (--curve)
+ *
+ * Sweep the target QPS upwards by doubling until the server (or the
+ * client) saturates, then spend the rest of --curve_budget bisecting
+ * (geometrically) the interval whose 99th percentile read latency
+ * changes the most for its width, which is where the curve bends.
+ * Points are measured through session_step(), so each costs -t +
+ * --settle seconds rather than a reconnect and reload.
+ */
+struct curve_point_t {
+  int target;
+  double achieved;
+  double read[9], update[9];  // Average, then curve_nths.
+  uint64_t gets, sets, misses, skips;
+  bool saturated;
+};
+
+static const double curve_nths[] = { 1, 5, 10, 50, 90, 95, 99, 99.9 };
+#define CURVE_NTHS (sizeof(curve_nths) / sizeof(curve_nths[0]))
+#define CURVE_P99 7  // Index of the 99th percentile in read[]/update[].
+
+#ifdef USE_ADAPTIVE_SAMPLER
+static void curve_summary(AdaptiveSampler<Operation> &sampler, double *out) {
+  vector<double> copy;
+  for (auto i: sampler.samples) copy.push_back(i.time());
+  sort(copy.begin(), copy.end());
+
+  size_t l = copy.size();
+  for (size_t i = 0; i <= CURVE_NTHS; i++) out[i] = 0.0;
+  if (l == 0) return;
+
+  out[0] = std::accumulate(copy.begin(), copy.end(), 0.0) / l;
+  for (size_t i = 0; i < CURVE_NTHS; i++)
+    out[i + 1] = copy[(size_t) (l * curve_nths[i] / 100)];
+}
+#else
+template <class S> static void curve_summary(S &sampler, double *out) {
+  for (size_t i = 0; i <= CURVE_NTHS; i++) out[i] = 0.0;
+  if (sampler.total() == 0) return;
+
+  out[0] = sampler.average();
+  for (size_t i = 0; i < CURVE_NTHS; i++)
+    out[i + 1] = sampler.get_nth(curve_nths[i]);
+}
+#endif
+
+static curve_point_t curve_measure(const vector<string> &servers,
+                                   options_t &options, int q) {
+  args_to_options(&options);
+
+  options.qps = q;
+  options.lambda = (double) options.qps / (double) options.lambda_denom * args.lambda_mul_arg;
+
+  ConnectionStats stats;
+  session_step(servers, options, stats);
+
+  curve_point_t p;
+  p.target = q;
+  p.achieved = stats.get_qps();
+  curve_summary(stats.get_sampler, p.read);
+  curve_summary(stats.set_sampler, p.update);
+  p.gets = stats.gets;
+  p.sets = stats.sets;
+  p.misses = stats.get_misses;
+  p.skips = stats.skips;
+  p.saturated = stats.client_saturated();
+
+  I("Curve: %d QPS target, %.1f achieved, read 99th %.1fus%s", q,
+    p.achieved, p.read[CURVE_P99], p.saturated ? " (client saturated)" : "");
+
+  return p;
+}
+
+static void curve_print(FILE *f, vector<curve_point_t> &points) {
+  bool json = !strcmp(args.curve_format_arg, "json");
+
+  if (json) {
+    fprintf(f, "[\n");
+  } else {
+    fprintf(f, "target,achieved");
+    for (const char *tag: {"read", "update"}) {
+      fprintf(f, ",%s_avg", tag);
+      for (size_t i = 0; i < CURVE_NTHS; i++)
+        fprintf(f, ",%s_p%g", tag, curve_nths[i]);
+    }
+    fprintf(f, ",gets,sets,misses,skips,client_saturated\n");
+  }
+
+  for (size_t n = 0; n < points.size(); n++) {
+    curve_point_t &p = points[n];
+
+    if (json) {
+      fprintf(f, "  {\"target\": %d, \"achieved\": %.1f", p.target,
+              p.achieved);
+      for (int u = 0; u < 2; u++) {
+        double *v = u ? p.update : p.read;
+        fprintf(f, ", \"%s\": {\"avg\": %.1f", u ? "update" : "read", v[0]);
+        for (size_t i = 0; i < CURVE_NTHS; i++)
+          fprintf(f, ", \"p%g\": %.1f", curve_nths[i], v[i + 1]);
+        fprintf(f, "}");
+      }
+      fprintf(f, ", \"gets\": %" PRIu64 ", \"sets\": %" PRIu64
+              ", \"misses\": %" PRIu64 ", \"skips\": %" PRIu64
+              ", \"client_saturated\": %s}%s\n", p.gets, p.sets, p.misses,
+              p.skips, p.saturated ? "true" : "false",
+              n + 1 < points.size() ? "," : "");
+    } else {
+      fprintf(f, "%d,%.1f", p.target, p.achieved);
+      for (int u = 0; u < 2; u++) {
+        double *v = u ? p.update : p.read;
+        for (size_t i = 0; i <= CURVE_NTHS; i++) fprintf(f, ",%.1f", v[i]);
+      }
+      fprintf(f, ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%d\n",
+              p.gets, p.sets, p.misses, p.skips, p.saturated ? 1 : 0);
+    }
+  }
+
+  if (json) fprintf(f, "]\n");
+}
+
+void auto_curve(const vector<string> &servers, options_t &options) {
+  vector<curve_point_t> points;
+  double begin = get_time();
+  double cost = 0.0;  // Wall time of the most expensive point so far.
+
+  if (!args.reload_given) session_open(servers, options);
+
+  auto measure = [&](int q) {
+    double t = get_time();
+    points.push_back(curve_measure(servers, options, q));
+    cost = max(cost, get_time() - t);
+  };
+  auto budget_left = [&]() {
+    return get_time() - begin + cost <= args.curve_budget_arg;
+  };
+
+  // Coarse sweep up to saturation: QPS falls short of the target,
+  // tail latency blows up, or the client itself gives out.
+  int q = options.qps > 0 ? options.qps : 1000;
+  measure(q);
+  double base_p99 = points[0].read[CURVE_P99];
+
+  while (budget_left() && q < 1000000000) {
+    curve_point_t &p = points.back();
+    if (p.achieved < 0.9 * p.target || p.saturated ||
+        (base_p99 > 0.0 && p.read[CURVE_P99] > 10 * base_p99))
+      break;
+
+    q *= 2;
+    measure(q);
+  }
+
+  // Refine: split the interval where log(p99) and log(achieved /
+  // target) change the most, weighted by its width so that noise
+  // between close points does not soak up the budget, until the curve
+  // is smooth everywhere or the budget runs out.
+  while (budget_left()) {
+    sort(points.begin(), points.end(),
+         [](const curve_point_t &a, const curve_point_t &b) {
+           return a.target < b.target;
+         });
+
+    double best = 0.0;
+    int lo = -1;
+
+    for (size_t i = 0; i + 1 < points.size(); i++) {
+      double a = points[i].read[CURVE_P99];
+      double b = points[i + 1].read[CURVE_P99];
+      if (a <= 0.0 || b <= 0.0) continue;
+      if (points[i + 1].target < points[i].target * 1.05) continue;
+
+      // Where the server falls behind, achieved/target bends too.
+      double bend = fabs(log(b / a)) +
+        fabs(log(points[i + 1].achieved / points[i + 1].target *
+                 points[i].target / max(points[i].achieved, 1.0)));
+      if (bend < log(1.2)) continue;
+
+      bend *= log((double) points[i + 1].target / points[i].target);
+      if (bend > best) { best = bend; lo = i; }
+    }
+
+    if (lo < 0) break;
+
+    measure((int) sqrt((double) points[lo].target * points[lo + 1].target));
+  }
+
+  session_close();
+
+  sort(points.begin(), points.end(),
+       [](const curve_point_t &a, const curve_point_t &b) {
+         return a.target < b.target;
+       });
+
+  I("Curve: %zu points in %.1fs.", points.size(), get_time() - begin);
+
+  FILE *f = stdout;
+  if (args.curve_out_given && (f = fopen(args.curve_out_arg, "w")) == NULL)
+    DIE("--curve_out: fopen(%s): %s", args.curve_out_arg, strerror(errno));
+
+  curve_print(f, points);
+
+  if (f != stdout) fclose(f);
+}
+
 string name_to_ipaddr(string host) {
   char *s_copy = new char[host.length() + 1];
   strcpy(s_copy, host.c_str());
@@ -437,12 +1154,110 @@ int main(int argc, char **argv) {
     DIE("--server or --agentmode must be specified.");
   if (args.loader_chunk_arg <= 0)
     DIE("--loader_chunk must be > 0");
-  if (!args.udp_given && args.rate_delay_given)
-    DIE("--rate_delay not supported for TCP; use --udp");
+  if (args.rate_delay_arg < 0)
+    DIE("--rate_delay must be >= 0");
+  if (args.measure_load_given && (args.noload_given || args.procs_arg > 1))
+    DIE("--measure_load cannot be combined with --noload or --procs");
+  if (args.churn_given && args.churn_arg < 1) DIE("--churn must be >= 1");
+  if (args.churn_given && args.udp_given)
+    DIE("--churn cannot be combined with --udp");
+  if (args.churn_rate_given && (!args.churn_given || args.churn_rate_arg <= 0))
+    DIE("--churn_rate must be > 0 and requires --churn");
+  if (args.hedge_given &&
+      (args.server_given < 2 || args.roundrobin_given || args.udp_given))
+    DIE("--hedge needs two or more --server, and no --roundrobin or --udp");
+  // Requests, duplicates and their latency are not carried in AgentStats.
+  if (args.hedge_given && (args.procs_arg > 1 || args.agent_given))
+    DIE("--hedge does not support --procs or --agent");
+  if (args.fanout_given &&
+      (args.fanout_arg < 1 || args.fanout_arg > (int) args.server_given ||
+       args.roundrobin_given || args.udp_given || args.hedge_given))
+    DIE("--fanout must be >= 1 and <= the number of --server, and cannot "
+        "be combined with --roundrobin, --udp or --hedge");
+  if (args.ketama_given && (args.roundrobin_given || args.agent_given ||
+                            args.hedge_given || args.fanout_given))
+    DIE("--ketama cannot be combined with --roundrobin, --agent, --hedge "
+        "or --fanout");
+  if (args.ketama_weights_given && !args.ketama_given)
+    DIE("--ketama_weights requires --ketama");
+  if (args.vbuckets_given && (!args.binary_given || args.ketama_given ||
+                              args.roundrobin_given || args.agent_given ||
+                              args.hedge_given || args.fanout_given))
+    DIE("--vbuckets requires --binary, and cannot be combined with "
+        "--ketama, --roundrobin, --agent, --hedge or --fanout");
+  if (args.vbucket_map_given && !args.vbuckets_given)
+    DIE("--vbucket_map requires --vbuckets");
+  if (args.multiget_given &&
+      (args.multiget_arg < 1 || args.udp_given || args.ratio_given ||
+       args.hedge_given || args.fanout_given || args.ketama_given ||
+       args.vbuckets_given))
+    DIE("--multiget must be >= 1, and cannot be combined with --udp, "
+        "--ratio, --hedge, --fanout, --ketama or --vbuckets");
+  if (args.meta_given &&
+      (args.binary_given || args.udp_given || args.multiget_given ||
+       args.username_given || strlen(args.meta_flags_arg) >= 32))
+    DIE("--meta cannot be combined with --binary, --udp, --multiget or "
+        "--username, and --meta_flags must be under 32 characters");
+  if (args.meta_flags_given && !args.meta_given)
+    DIE("--meta_flags requires --meta");
+  if (args.quiet_ops_given &&
+      (!(args.binary_given || args.meta_given) || args.udp_given ||
+       args.multiget_given || args.hedge_given || args.fanout_given ||
+       args.ketama_given || args.vbuckets_given))
+    DIE("--quiet_ops requires --binary or --meta, and cannot be combined "
+        "with --udp, --multiget, --hedge, --fanout, --ketama or --vbuckets");
+  if ((args.hedge_given || args.fanout_given) && args.ratio_given)
+    DIE("--hedge and --fanout cannot be combined with --ratio");
+  if (args.timeout_given && args.timeout_arg <= 0)
+    DIE("--timeout must be > 0");
+  if ((args.reconnect_given || args.timeout_given) && args.udp_given)
+    DIE("--reconnect and --timeout cannot be combined with --udp");
+  // The disruption timeline does not fit in AgentStats.
+  if ((args.reconnect_given || args.timeout_given) &&
+      (args.procs_arg > 1 || args.agent_given))
+    DIE("--reconnect and --timeout do not support --procs or --agent");
+  if (args.wheel_given && args.wheel_arg < 0.001)
+    DIE("--wheel must be >= 0.001 (1ns)");
+  if (args.settle_arg < 0) DIE("--settle must be >= 0");
+  if (args.slo_given) {
+    if (args.scan_given || args.search_given)
+      DIE("--slo cannot be combined with --scan or --search");
+    if (args.procs_arg > 1 || args.agent_given)
+      DIE("--slo does not support --procs or --agent");
+    if (args.slo_window_arg <= 0) DIE("--slo_window must be > 0");
+  }
+  if (args.curve_given) {
+    if (args.scan_given || args.search_given || args.slo_given)
+      DIE("--curve cannot be combined with --scan, --search or --slo");
+    if (strcmp(args.curve_format_arg, "csv") &&
+        strcmp(args.curve_format_arg, "json"))
+      DIE("--curve_format must be csv or json");
+  }
+  if (args.procs_arg < 1 || args.procs_arg > MAXIMUM_PROCS)
+    DIE("--procs must be >= 1 and <= %d", MAXIMUM_PROCS);
+
+  if (args.numa_given) numa_init(args.numa_arg);
 
   // TODO: Discover peers, share arguments.
 
+  // Every Connection is a socket.
+  uint64_t fds = raise_fd_limit();
+
+  for (unsigned int i = 0; i < args.source_addr_given; i++) {
+    struct sockaddr_storage ss;
+    int len = sizeof(ss);
+
+    if (evutil_parse_sockaddr_port(args.source_addr_arg[i],
+                                   (struct sockaddr *) &ss, &len))
+      DIE("Invalid --source_addr: %s", args.source_addr_arg[i]);
+
+    source_addrs.addrs.push_back(ss);
+    source_addrs.lens.push_back(len);
+  }
+
+  clock_init();
   init_random_stuff();
+  if (args.load_file_given) dataset = new Dataset(args.load_file_arg);
   boot_time = get_time();
   setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -471,12 +1286,46 @@ int main(int argc, char **argv) {
   options_t options;
   args_to_options(&options);
 
+  if (args.ketama_given) {
+    ketama = new Ketama(args.server_arg, args.server_given,
+                        args.ketama_weights_given ?
+                        args.ketama_weights_arg : NULL);
+    assign_records(options);
+  }
+
+  if (args.vbuckets_given) {
+    vbuckets = new VBucketMap(args.vbuckets_arg, args.vbucket_map_given ?
+                              args.vbucket_map_arg : NULL,
+                              args.server_given);
+    assign_records(options);
+  }
+
+  uint64_t conns = args.measure_connections_given ?
+    max(args.measure_connections_arg, options.connections) :
+    options.connections;
+  conns *= options.server_given * options.threads;
+  if (fds < conns + 64)
+    W("%" PRIu64 " connections per process, but only %" PRIu64 " file "
+      "descriptors; raise the hard limit (ulimit -Hn).", conns, fds);
+
   pthread_barrier_init(&barrier, NULL, options.threads);
 
+  if (options.procs > 1) init_procs(options);
+
   vector<string> servers;
   for (unsigned int s = 0; s < args.server_given; s++)
     servers.push_back(name_to_ipaddr(string(args.server_arg[s])));
 
+  if (args.slo_given) {
+    if (options.qps <= 0) {
+      options.qps = 1000;
+      options.lambda = (double) options.qps / (double) options.lambda_denom * args.lambda_mul_arg;
+    }
+
+    qps_controller = new QpsController(args.slo_arg, options.qps,
+                                       args.slo_window_arg, options.threads);
+  }
+
   ConnectionStats stats;
 
   double peak_qps = 0.0;
@@ -492,12 +1341,14 @@ int main(int argc, char **argv) {
 
     I("Search-mode.  Find QPS @ %dus %dth percentile.", x, n);
 
+    if (!args.reload_given) session_open(servers, options);
+
     int high_qps = 2000000;
     int low_qps = 1; // 5000;
     double nth;
     int cur_qps;
 
-    go(servers, options, stats);
+    session_step(servers, options, stats);
 
     nth = stats.get_nth(n);
     peak_qps = stats.get_qps();
@@ -518,11 +1369,13 @@ int main(int argc, char **argv) {
 
       stats = ConnectionStats();
 
-      go(servers, options, stats);
+      session_step(servers, options, stats);
 
       nth = stats.get_nth(n);
 
       I("cur_qps = %d, get_qps = %f, nth = %f", cur_qps, stats.get_qps(), nth);
+      if (stats.client_saturated())
+        W("Client saturated at %d QPS; this probe is suspect.", cur_qps);
 
       if (nth > x /*|| cur_qps > stats.get_qps() * 1.05*/) high_qps = cur_qps;
       else low_qps = cur_qps;
@@ -540,7 +1393,7 @@ int main(int argc, char **argv) {
 
       stats = ConnectionStats();
 
-      go(servers, options, stats);
+      session_step(servers, options, stats);
 
       nth = stats.get_nth(n);
 
@@ -548,6 +1401,10 @@ int main(int argc, char **argv) {
     }
 
     }
+
+    session_close();
+  } else if (args.curve_given) {
+    auto_curve(servers, options);
   } else if (args.scan_given) {
     char *min_ptr = strtok(args.scan_arg, ":");
     char *max_ptr = strtok(NULL, ":");
@@ -560,6 +1417,8 @@ int main(int argc, char **argv) {
     int max = atoi(max_ptr);
     int step = atoi(step_ptr);
 
+    if (!args.reload_given) session_open(servers, options);
+
     printf("%-7s %7s %7s %7s %7s %7s %7s %7s %7s %8s %8s\n",
            "#type", "avg", "min", "1st", "5th", "10th",
            "90th", "95th", "99th", "QPS", "target");
@@ -575,21 +1434,34 @@ int main(int argc, char **argv) {
 
       stats = ConnectionStats();
 
-      go(servers, options, stats);
+      session_step(servers, options, stats);
 
       stats.print_stats("read", stats.get_sampler, false);
       printf(" %8.1f", stats.get_qps());
       printf(" %8d\n", q);
-    }    
+
+      if (stats.client_saturated())
+        W("Client saturated at %d QPS; this and later steps are suspect.", q);
+    }
+
+    session_close();
   } else {
     go(servers, options, stats);
   }
 
-  if (!args.scan_given && !args.loadonly_given) {
+  if (!args.scan_given && !args.curve_given && !args.loadonly_given) {
     stats.print_header();
     stats.print_stats("read",   stats.get_sampler);
     stats.print_stats("update", stats.set_sampler);
     stats.print_stats("op_q",   stats.op_sampler);
+    if (args.hedge_given || args.fanout_given)
+      stats.print_stats("request", stats.request_sampler);
+
+    if (args.churn_given) {
+      stats.print_stats("connect", stats.connect_sampler);
+      if (args.username_given) stats.print_stats("sasl", stats.sasl_sampler);
+      stats.print_stats("fresh",  stats.fresh_sampler);
+    }
 
     int total = stats.gets + stats.sets;
 
@@ -600,14 +1472,57 @@ int main(int argc, char **argv) {
     if (args.search_given && peak_qps > 0.0)
       printf("Peak QPS  = %.1f\n", peak_qps);
 
+    if (args.multiget_given)
+      printf("Keys/s    = %.1f (%" PRIu64 " keys in %" PRIu64 " gets)\n",
+             stats.get_keys / (stats.stop - stats.start), stats.get_keys,
+             stats.gets);
+
+    if (qps_controller) qps_controller->report();
+
     printf("\n");
 
+    // --multiget: per key.
+    uint64_t asked = args.multiget_given ? stats.get_keys : stats.gets;
     printf("Misses = %" PRIu64 " (%.1f%%)\n", stats.get_misses,
-           (double) stats.get_misses/stats.gets*100);
+           (double) stats.get_misses/asked*100);
 
     printf("Skipped TXs = %" PRIu64 " (%.1f%%)\n\n", stats.skips,
            (double) stats.skips / total * 100);
 
+    if (args.quiet_ops_given || stats.dropped || stats.reordered)
+      printf("Dropped replies = %" PRIu64 ", reordered replies = %" PRIu64
+             "\n\n", stats.dropped, stats.reordered);
+
+    if (args.reconnect_given || args.timeout_given) print_disruption(stats);
+
+    if (args.fanout_given) print_fanout(stats);
+    if (ketama || vbuckets) print_shards(stats);
+
+    if (args.hedge_given && stats.requests > 0)
+      printf("Hedged = %" PRIu64 " (%.1f%% of requests, %.1f%% extra load), "
+             "duplicate answered first %" PRIu64 " times\n\n",
+             stats.hedges, 100.0 * stats.hedges / stats.requests,
+             (uint64_t) total > stats.hedges ?
+             100.0 * stats.hedges / (total - stats.hedges) : 0.0,
+             stats.hedge_wins);
+
+    if (args.churn_given)
+      printf("Reopened connections = %" PRIu64 " (%.1f/s)\n\n",
+             stats.churned, stats.churned / (stats.stop - stats.start));
+
+    printf("Client busy = %.1f%% avg, %.1f%% max thread "
+           "(%" PRIu64 " loops, %.1f ops/wakeup)\n",
+           stats.get_utilization() * 100, stats.busy_max * 100,
+           stats.loop_iterations,
+           stats.wakeups ? (double) total / stats.wakeups : 0.0);
+    printf("Timer lateness = %.1fus avg, %.1fus max\n\n",
+           stats.get_timer_lateness() * 1000000,
+           stats.timer_lateness_max * 1000000);
+
+    if (stats.client_saturated())
+      printf("WARNING: client saturated; QPS and latency above reflect "
+             "the client, not the server.\n\n");
+
     printf("RX %10" PRIu64 " bytes : %6.1f MB/s\n",
            stats.rx_bytes,
            (double) stats.rx_bytes / 1024 / 1024 / (stats.stop - stats.start));
@@ -623,7 +1538,8 @@ int main(int argc, char **argv) {
         DIE("--save: failed to open %s: %s", args.save_arg, strerror(errno));
 
       for (auto i: stats.get_sampler.samples) {
-        fprintf(file, "%f %f\n", i.start_time - boot_time, i.time());
+        fprintf(file, "%f %f\n", i.start_time / 1000000000.0 - boot_time,
+                i.time());
       }
     }
   }
@@ -631,6 +1547,18 @@ int main(int argc, char **argv) {
   //  if (args.threads_arg > 1) 
     pthread_barrier_destroy(&barrier);
 
+  delete qps_controller;
+  delete ketama;
+  delete vbuckets;
+  delete dataset;
+
+  if (loader_shm) munmap(loader_shm, loader_shm_size);
+
+  if (procs_shm) {
+    pthread_barrier_destroy(&procs_shm->barrier);
+    munmap(procs_shm, sizeof(procs_shm_t));
+  }
+
 #ifdef HAVE_LIBZMQ
   if (args.agent_given) {
     for (auto i: agent_sockets) delete i;
@@ -655,6 +1583,11 @@ void go(const vector<string>& servers, options_t& options,
   }
 #endif
 
+  prep_loader(servers);
+  connects = connect_failures = 0;
+  connect_sampler = LogHistogramSampler(200);
+  if (options.procs > 1) prep_procs(options);
+
   if (options.threads > 1) {
     pthread_t pt[options.threads];
     struct thread_data td[options.threads];
@@ -666,6 +1599,10 @@ void go(const vector<string>& servers, options_t& options,
 
     int current_cpu = -1;
 
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed))
+      DIE("sched_getaffinity() failed: %s", strerror(errno));
+
     for (int t = 0; t < options.threads; t++) {
       td[t].options = &options;
 #ifdef HAVE_LIBZMQ
@@ -673,6 +1610,7 @@ void go(const vector<string>& servers, options_t& options,
 #endif
       if (t == 0) td[t].master = true;
       else td[t].master = false;
+      td[t].numa_node = -1;
 
       if (options.roundrobin) {
         for (unsigned int i = (t % servers.size());
@@ -687,7 +1625,17 @@ void go(const vector<string>& servers, options_t& options,
       pthread_attr_t attr;
       pthread_attr_init(&attr);
 
-      if (args.affinity_given) {
+      if (args.numa_given) {
+        cpu_set_t m;
+        td[t].numa_node = numa_place(t, &allowed, args.affinity_given, &m);
+
+        int ret;
+        if ((ret = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &m)))
+          DIE("pthread_attr_setaffinity_np() failed: %s", strerror(ret));
+
+        I("Thread %d on NUMA node %d, CPUs %s.", t, td[t].numa_node,
+          cpuset_to_string(&m).c_str());
+      } else if (args.affinity_given) {
         int max_cpus = 8 * sizeof(cpu_set_t);
         cpu_set_t m;
         CPU_ZERO(&m);
@@ -716,10 +1664,31 @@ void go(const vector<string>& servers, options_t& options,
     for (int t = 0; t < options.threads; t++) {
       ConnectionStats *cs;
       if (pthread_join(pt[t], (void**) &cs)) DIE("pthread_join() failed");
+
+      V("Thread %d: busy %.1f%%, %" PRIu64 " loops, %.1f ops/wakeup, "
+        "timer lateness %.1fus avg %.1fus max", t,
+        cs->get_utilization() * 100, cs->loop_iterations,
+        cs->wakeups ? (double) (cs->gets + cs->sets) / cs->wakeups : 0.0,
+        cs->get_timer_lateness() * 1000000, cs->timer_lateness_max * 1000000);
+
       stats.accumulate(*cs);
       delete cs;
     }
   } else if (options.threads == 1) {
+    if (args.numa_given) {
+      cpu_set_t allowed, m;
+      if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed))
+        DIE("sched_getaffinity() failed: %s", strerror(errno));
+
+      int node = numa_place(0, &allowed, args.affinity_given, &m);
+      if (sched_setaffinity(0, sizeof(cpu_set_t), &m))
+        DIE("sched_setaffinity() failed: %s", strerror(errno));
+      numa_bind_memory(node);
+
+      I("Thread 0 on NUMA node %d, CPUs %s.", node,
+        cpuset_to_string(&m).c_str());
+    }
+
     do_mutilate(servers, options, stats, true
 #ifdef HAVE_LIBZMQ
 , socket
@@ -733,6 +1702,8 @@ void go(const vector<string>& servers, options_t& options,
 #endif
   }
 
+  if (options.procs > 1) finish_procs(stats);
+
 #ifdef HAVE_LIBZMQ
   if (args.agent_given > 0) {
     int total = stats.gets + stats.sets;
@@ -749,6 +1720,10 @@ void go(const vector<string>& servers, options_t& options,
 void* thread_main(void *arg) {
   struct thread_data *td = (struct thread_data *) arg;
 
+  // Must come first, so that everything do_mutilate() allocates
+  // (event_base, Connections, bufferevents) lands on our node.
+  if (td->numa_node >= 0) numa_bind_memory(td->numa_node);
+
   ConnectionStats *cs = new ConnectionStats();
 
   do_mutilate(*td->servers, *td->options, *cs, td->master
@@ -760,6 +1735,146 @@ void* thread_main(void *arg) {
   return cs;
 }
 
+static void timeout_cb(evutil_socket_t fd, short what, void *ptr) {
+  vector<Connection*> *connections = (vector<Connection*> *) ptr;
+  int64_t now = get_ns();
+
+  for (Connection *conn: *connections) conn->check_timeout(now);
+}
+
+// Wait for all Connections to become IDLE, then reset them and their
+// stats.
+static void drain(vector<Connection*> &connections, conn_group_t &group,
+                  RunController &run, struct event_base *base) {
+  run.begin();
+  for (Connection *conn: connections)
+    if (conn->read_state != Connection::IDLE)
+      conn->join_run();  // Leaves once its op_queue drains.
+
+  while (run.active > 0) event_base_loop(base, EVLOOP_ONCE);
+
+  for (Connection *conn: connections) conn->reset();
+  group.reset_stats();
+}
+
+// Run all Connections for `duration' seconds without keeping stats
+// (warmup, --settle).
+static void warm(vector<Connection*> &connections, conn_group_t &group,
+                 RunController &run, struct event_base *base, int loop_flag,
+                 double duration) {
+  double start = get_time();
+  run.start(duration);
+  for (Connection *conn: connections) {
+    conn->start_time = start;
+    conn->join_run();
+    conn->drive_write_machine(); // Kick the Connection into motion.
+  }
+
+  while (run.running()) event_base_loop(base, loop_flag);
+
+  drain(connections, group, run, base);
+}
+
+// Synchronize with the other threads, processes and agents, run for
+// options.time and add the Connections' stats to `stats'.
+static void measure(vector<Connection*> &connections, conn_group_t &group,
+                    RunController &run, struct event_base *base, int loop_flag,
+                    options_t &options, ConnectionStats &stats, bool master
+#ifdef HAVE_LIBZMQ
+, zmq::socket_t* socket
+#endif
+) {
+  // FIXME: Synchronize start_time here across threads/nodes.
+  pthread_barrier_wait(&barrier);
+
+  if (master && args.wait_given) {
+    if (get_time() < boot_time + args.wait_arg) {
+      double t = (boot_time + args.wait_arg)-get_time();
+      V("Sleeping %.1fs for -W.", t);
+      sleep_time(t);
+    }
+  }
+
+  synchronize(master, options
+#ifdef HAVE_LIBZMQ
+, socket
+#endif
+);
+
+  if (master && !args.scan_given && !args.search_given)
+    V("started at %f", get_time());
+
+  double start = get_time();
+  run.start(options.time);
+  if (options.reconnect) group.stats.timeline_start = get_ns();
+  for (Connection *conn: connections) {
+    conn->start_time = start;
+    conn->join_run();
+    conn->drive_write_machine(); // Kick the Connection into motion.
+  }  
+
+  //  V("Start = %f", start);
+
+  // A blocking loop sleeps in epoll() when idle, so thread CPU time is
+  // its busy time.  A non-blocking loop spins, so instead count the
+  // time spent in iterations that ran at least one callback.
+  double cpu_start = get_thread_cpu_time();
+  double busy = 0.0;
+  double now = start;
+
+  // --slo: feed this thread's window to the controller and follow its
+  // target.
+  qps_window_t window;
+  double next_window = start;
+  unsigned int epoch = 0;
+
+  if (qps_controller) {
+    next_window += qps_controller->window;
+    group.stats.window = &window;
+  }
+
+  // Main event loop.
+  while (run.running()) {
+    uint64_t wakeups = thread_wakeups;
+    double last = now;
+
+    event_base_loop(base, loop_flag);   // NONBLOCK by default
+    stats.loop_iterations++;
+
+    now = get_time();
+
+    if (thread_wakeups != wakeups) busy += now - last;
+
+    if (qps_controller) {
+      if (now >= next_window) {
+        qps_controller->contribute(&window);
+        next_window += qps_controller->window;
+      }
+
+      double qps;
+      if (qps_controller->changed(&epoch, &qps)) {
+        double lambda = qps / options.lambda_denom * args.lambda_mul_arg;
+        group.set_lambda(lambda);
+      }
+    }
+  }
+
+  group.stats.window = NULL;
+
+  if (master && !args.scan_given && !args.search_given)
+    V("stopped at %f  options.time = %d", get_time(), options.time);
+
+  stats.accumulate(group.stats);
+
+  stats.start = start;
+  stats.stop = now;
+
+  stats.busy_time = loop_flag == EVLOOP_NONBLOCK ? busy :
+    get_thread_cpu_time() - cpu_start;
+  stats.client_time = now - start;
+  stats.busy_max = stats.get_utilization();
+}
+
 void do_mutilate(const vector<string>& servers, options_t& options,
                  ConnectionStats& stats, bool master
 #ifdef HAVE_LIBZMQ
@@ -791,14 +1906,36 @@ void do_mutilate(const vector<string>& servers, options_t& options,
 
   //  event_base_priority_init(base, 2);
 
-  // FIXME: May want to move this to after all connections established.
-  double start = get_time();
-  double now = start;
-
   vector<Connection*> connections;
-  vector<Connection*> server_lead;
+  vector<load_cursor_t*> cursors;  // Of each Connection's server.
+
+  RunController run(base);
+  run.begin();
+
+  TimingWheel *wheel = NULL;
+  if (options.wheel_slot > 0)
+    wheel = new TimingWheel(base, options.wheel_slot, options.wheel_spin);
+
+  conn_group_t group(options, args.agentmode_given || proc_index > 0 ?
+                     false : true);
+
+  // --ratio: which records are in memcached, as this thread sees them.
+  // Each server holds all of them, unless --ketama or --vbuckets shards
+  // them.
+  if (options.ratioSum) {
+    int n = ketama || vbuckets ? 1 : servers.size();
+    for (int s = 0; s < n; s++)
+      group.key_state.push_back(new KeyBitmap(options.records));
+  }
+  if (source_addrs.addrs.size()) group.sources = &source_addrs;
+  if (args.hedge_given) group.hedger = new Hedger(base, args.hedge_arg);
+  group.pools.resize(servers.size());
+
+  double connect_start = get_time();
+
+  for (unsigned int i = 0; i < servers.size(); i++) {
+    const string &s = servers[i];
 
-  for (auto s: servers) {
     // Split args.server_arg[s] into host:port using strtok().
     char *s_copy = new char[s.length() + 1];
     strcpy(s_copy, s.c_str());
@@ -818,64 +1955,116 @@ void do_mutilate(const vector<string>& servers, options_t& options,
       options.connections;
 
     for (int c = 0; c < conns; c++) {
-      Connection* conn = new Connection(base, evdns, hostname, port, options,
-                                        args.agentmode_given ? false :
-                                        true);
+      Connection* conn = new Connection(base, evdns, hostname, port, &group,
+                                        &run, wheel);
+      conn->server = i;
+      conn->slot = c;
+      group.pools[i].push_back(conn);
+      if (!options.udp) conn->join_run();  // Leaves once connected.
       connections.push_back(conn);
-      if (c == 0) server_lead.push_back(conn);
+      cursors.push_back(loader_cursor(s));
     }
   }
 
   // Wait for all Connections to become IDLE.
+  while (run.active > 0) event_base_loop(base, EVLOOP_ONCE);
+
   if (!options.udp) {
-    while (1) {
-      // FIXME: If all connections become ready before event_base_loopevent
-      // is called, this will deadlock.
-      event_base_loop(base, EVLOOP_ONCE);
+    pthread_mutex_lock(&connect_lock);
+    connects += group.connects;
+    connect_failures += group.connect_failures;
+    connect_sampler.accumulate(group.connect_sampler);
+    pthread_mutex_unlock(&connect_lock);
+
+    pthread_barrier_wait(&barrier);
 
-      bool restart = false;
-      for (Connection *conn: connections)
-        if (conn->read_state != Connection::IDLE)
-          restart = true;
+    if (master) {
+      double t = get_time() - connect_start;
 
-      if (restart) continue;
-       else break;
+      I("%sConnected %" PRIu64 " in %.2fs: %.0f/s, %.0fus avg, %.0fus 99th, "
+        "%" PRIu64 " failed attempts.",
+        options.procs > 1 ? ("Process " + to_string(proc_index) + ": ").c_str()
+        : "", connects, t, connects / t, connect_sampler.average(),
+        connect_sampler.get_nth(99), connect_failures);
     }
   }
 
-  // Load database on lead connection for each server.
+  // Load database, split across every Connection of every thread.
   if (!options.noload) {
-    V("Loading database.");
+    if (master) V("Loading database.");
+    double load_start = get_time();
 
-    for (auto c: server_lead)
-      c->start_loading();
+    run.begin();
+    for (unsigned int i = 0; i < connections.size(); i++) {
+      connections[i]->join_run();  // Leaves once loaded.
+      connections[i]->start_loading(cursors[i]);
+    }
 
-  // Wait for all Connections to become IDLE.
+    // Wait for all Connections to become IDLE.
+    while (run.active > 0) event_base_loop(base, EVLOOP_ONCE);
+
+    if (options.measure_load) {
+      pthread_mutex_lock(&load_lock);
+      load_stats.accumulate(group.stats);
+      for (Connection *conn: connections) {
+        auto &tl = conn->loader_timeline;
+        if (load_timeline.size() < tl.size())
+          load_timeline.resize(tl.size(), 0);
+        for (size_t i = 0; i < tl.size(); i++) load_timeline[i] += tl[i];
+      }
+      pthread_mutex_unlock(&load_lock);
 
-    while (1) {
-      // FIXME: If all connections become ready before event_base_loop
-      // is called, this will deadlock.
-      event_base_loop(base, EVLOOP_ONCE);
+      for (Connection *conn: connections) conn->reset();
+      group.reset_stats();
+    }
 
-      bool restart = false;
-     for (Connection *conn: connections)
-        if (conn->read_state != Connection::IDLE)
-          restart = true;
+    for (Connection *conn: connections) {
+      __atomic_add_fetch(&loader_shm->records, conn->loader_completed,
+                         __ATOMIC_RELAXED);
+      __atomic_add_fetch(&loader_shm->bytes, conn->loader_bytes,
+                         __ATOMIC_RELAXED);
+      __atomic_add_fetch(&loader_shm->errors, conn->loader_errors,
+                         __ATOMIC_RELAXED);
+    }
 
-      if (restart) continue;
-      else break;
+    pthread_barrier_wait(&barrier);
+    if (master && options.procs > 1)
+      pthread_barrier_wait(&procs_shm->barrier);
+
+    if (master && proc_index == 0) {
+      double t = get_time() - load_start;
+
+      I("Loaded %" PRIu64 " records in %.2fs: %.0f records/s, %.1f MB/s.",
+        loader_shm->records, t, loader_shm->records / t,
+        loader_shm->bytes / t / 1000000);
+      if (loader_shm->errors)
+        W("%" PRIu64 " sets failed while loading.", loader_shm->errors);
+
+      if (options.measure_load) print_load_stats(load_start, get_time());
     }
-  }
-  else {
-    if (options.ratioSum) ; 
+
+    // Together, the threads have loaded every record.
+    for (KeyBitmap *keys: group.key_state) keys->fill();
   }
 
   if (options.loadonly) {
+    for (Connection *conn: connections) delete conn;
+    for (KeyBitmap *keys: group.key_state) delete keys;
+    delete wheel;
     evdns_base_free(evdns, 0);
     event_base_free(base);
     return;
   }
 
+  // --timeout: look for overdue requests a few times per timeout.
+  struct event *timeout_sweep = NULL;
+  if (options.timeout) {
+    struct timeval tv;
+    timeout_sweep = event_new(base, -1, EV_PERSIST, timeout_cb, &connections);
+    ns_to_tv(std::max<int64_t>(options.timeout / 4, 1000000), &tv);
+    event_add(timeout_sweep, &tv);
+  }
+
   // FIXME: Remove.  Not needed, testing only.
   //  // FIXME: Synchronize start_time here across threads/nodes.
   //  pthread_barrier_wait(&barrier);
@@ -884,153 +2073,56 @@ void do_mutilate(const vector<string>& servers, options_t& options,
   if (options.warmup > 0) {
     if (master) V("Warmup start.");
 
+    synchronize(master, options
 #ifdef HAVE_LIBZMQ
-    if (args.agent_given || args.agentmode_given) {
-      if (master) V("Synchronizing.");
-
-      // 1. thread barrier: make sure our threads ready before syncing agents
-      // 2. sync agents: all threads across all agents are now ready
-      // 3. thread barrier: don't release our threads until all agents ready
-      pthread_barrier_wait(&barrier);
-      if (master) sync_agent(socket);
-      pthread_barrier_wait(&barrier);
-
-      if (master) V("Synchronized.");
-    }
+, socket
 #endif
+);
 
-    int old_time = options.time;
-    //    options.time = 1;
-
-    start = get_time();
-    for (Connection *conn: connections) {
-      conn->start_time = start;
-      conn->options.time = options.warmup;
-      conn->drive_write_machine(); // Kick the Connection into motion.
-    }
-
-    while (1) {
-      event_base_loop(base, loop_flag);
-
-      //#ifdef USE_CLOCK_GETTIME
-      //      now = get_time();
-      //#else
-      struct timeval now_tv;
-      event_base_gettimeofday_cached(base, &now_tv);
-      now = tv_to_double(&now_tv);
-      //#endif
-
-      bool restart = false;
-      for (Connection *conn: connections)
-        if (!conn->check_exit_condition(now))
-          restart = true;
-
-      if (restart) continue;
-      else break;
-    }
-
-    bool restart = false;
-    for (Connection *conn: connections)
-      if (conn->read_state != Connection::IDLE)
-        restart = true;
-
-    if (restart) {
-
-      // Wait for all Connections to become IDLE.
-      while (1) {
-        // FIXME: If there were to use EVLOOP_ONCE and all connections
-        // become ready before event_base_loop is called, this will
-        // deadlock.  We should check for IDLE before calling
-        // event_base_loop.
-        event_base_loop(base, EVLOOP_ONCE); // EVLOOP_NONBLOCK);
-
-        bool restart = false;
-        for (Connection *conn: connections)
-          if (conn->read_state != Connection::IDLE)
-            restart = true;
-
-        if (restart) continue;
-        else break;
-      }
-    }
-
-    //    options.time = old_time;
-    for (Connection *conn: connections) {
-      conn->reset();
-      //      conn->stats = ConnectionStats();
-      conn->options.time = old_time;
-    }
+    warm(connections, group, run, base, loop_flag, options.warmup);
 
     if (master) V("Warmup stop.");
   }
 
-  // FIXME: Synchronize start_time here across threads/nodes.
-  pthread_barrier_wait(&barrier);
+  if (session.active) {
+    // One measurement per --scan/--search step; see session_t.
+    while (1) {
+      pthread_barrier_wait(&session.start);
+      if (session.done) break;
 
-  if (master && args.wait_given) {
-    if (get_time() < boot_time + args.wait_arg) {
-      double t = (boot_time + args.wait_arg)-get_time();
-      V("Sleeping %.1fs for -W.", t);
-      sleep_time(t);
-    }
-  }
+      group.set_lambda(session.lambda);
+      if (session.settle > 0)
+        warm(connections, group, run, base, loop_flag, session.settle);
 
+      ConnectionStats step;
+      measure(connections, group, run, base, loop_flag, options, step, master
 #ifdef HAVE_LIBZMQ
-  if (args.agent_given || args.agentmode_given) {
-    if (master) V("Synchronizing.");
-
-    pthread_barrier_wait(&barrier);
-    if (master) sync_agent(socket);
-    pthread_barrier_wait(&barrier);
-
-    if (master) V("Synchronized.");
-  }
+, socket
 #endif
+);
+      drain(connections, group, run, base);
 
-  if (master && !args.scan_given && !args.search_given)
-    V("started at %f", get_time());
-
-  start = get_time();
-  for (Connection *conn: connections) {
-    conn->start_time = start;
-    conn->drive_write_machine(); // Kick the Connection into motion.
-  }  
-
-  //  V("Start = %f", start);
-
-  // Main event loop.
-  while (1) {
-    event_base_loop(base, loop_flag);   // NONBLOCK by default
+      pthread_mutex_lock(&session.lock);
+      session.stats->accumulate(step);
+      pthread_mutex_unlock(&session.lock);
 
-    //#if USE_CLOCK_GETTIME
-    //    now = get_time();
-    //#else
-    struct timeval now_tv;
-    event_base_gettimeofday_cached(base, &now_tv);
-    now = tv_to_double(&now_tv);
-    //#endif
-
-    bool restart = false;
-    for (Connection *conn: connections)
-      if (!conn->check_exit_condition(now))
-        restart = true;
-
-    if (restart) continue;
-    else break;
+      pthread_barrier_wait(&session.finish);
+    }
+  } else {
+    measure(connections, group, run, base, loop_flag, options, stats, master
+#ifdef HAVE_LIBZMQ
+, socket
+#endif
+);
   }
 
-  if (master && !args.scan_given && !args.search_given)
-    V("stopped at %f  options.time = %d", get_time(), options.time);
+  // Tear-down.
+  for (Connection *conn: connections) delete conn;
 
-  // Tear-down and accumulate stats.
-  for (Connection *conn: connections) {
-    stats.accumulate(conn->stats);
-    delete conn;
-  }
-
-  stats.start = start;
-  stats.stop = now;
+  for (KeyBitmap *keys: group.key_state) delete keys;
+  delete wheel;
 
+  if (timeout_sweep) event_free(timeout_sweep);
   event_config_free(config);
   evdns_base_free(evdns, 0);
   event_base_free(base);
@@ -1042,6 +2134,7 @@ void args_to_options(options_t* options) {
   options->blocking = args.blocking_given;
   options->qps = args.qps_arg;
   options->threads = args.threads_arg;
+  options->procs = args.procs_arg;
   options->server_given = args.server_given;
   options->roundrobin = args.roundrobin_given;
 
@@ -1053,6 +2146,8 @@ void args_to_options(options_t* options) {
     connections *= options->server_given * options->threads;
   }
 
+  connections *= options->procs;
+
   //  if (args.agent_given) connections *= (1 + args.agent_given);
 
   options->lambda_denom = connections > 1 ? connections : 1;
@@ -1069,8 +2164,13 @@ void args_to_options(options_t* options) {
   //    options->records = args.records_arg;
   //  else
   options->records = args.records_arg / options->server_given;
+  if (args.ketama_given || args.vbuckets_given)
+    options->records = args.records_arg;  // Sharded.
+  if (dataset) options->records = dataset->size();  // All of it, everywhere.
 
   options->binary = args.binary_given;
+  options->meta = args.meta_given;
+  strcpy(options->meta_flags, args.meta_flags_arg);
   options->sasl = args.username_given;
   
   if (args.password_given)
@@ -1172,6 +2272,7 @@ void args_to_options(options_t* options) {
   options->update = args.update_arg;
   options->time = args.time_arg;
   options->loadonly = args.loadonly_given;
+  options->measure_load = args.measure_load_given;
   options->loader_chunk = args.loader_chunk_arg;
   options->rate_delay = args.rate_delay_arg;
   options->depth = args.depth_arg;
@@ -1182,7 +2283,16 @@ void args_to_options(options_t* options) {
   options->warmup = args.warmup_given ? args.warmup_arg : 0;
   options->oob_thread = false;
   options->skip = args.skip_given;
+  options->wheel_slot = args.wheel_given ? args.wheel_arg * 1000 : 0;
+  options->wheel_spin = args.wheel_spin_arg * 1000;
   options->moderate = args.moderate_given;
+  options->churn = args.churn_given ? args.churn_arg : 0;
+  options->churn_rate = args.churn_rate_given ? args.churn_rate_arg : 0;
+  options->reconnect = args.reconnect_given || args.timeout_given;
+  options->timeout = args.timeout_given ? args.timeout_arg * 1000000 : 0;
+  options->fanout = args.fanout_given ? args.fanout_arg : 0;
+  options->multiget = args.multiget_given ? args.multiget_arg : 0;
+  options->quiet_ops = args.quiet_ops_given;
 }
 
 void init_random_stuff() {
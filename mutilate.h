@@ -5,14 +5,28 @@
 
 #define USE_CACHED_TIME 0
 #define MINIMUM_KEY_LENGTH 2
-#define MAXIMUM_CONNECTIONS 512
+#define MAXIMUM_CONNECTIONS 65536
+#define MAXIMUM_PROCS 256
 
 #define MAX_SAMPLES 100000
 
+// Thresholds beyond which the client itself is considered the
+// bottleneck: busy fraction of the busiest thread, and mean timer
+// lateness in seconds.
+#define SATURATED_UTILIZATION 0.90
+#define SATURATED_TIMER_LATENESS 0.000100
+
 // this was made a command-line option
 // #define LOADER_CHUNK 1024
 
+class Dataset;
+class Ketama;
+class VBucketMap;
+
 extern char random_char[];
+extern Dataset *dataset;  // --load_file, or NULL.
+extern Ketama *ketama;    // --ketama, or NULL.
+extern VBucketMap *vbuckets;  // --vbuckets, or NULL.
 extern gengetopt_args_info args;
 
 #endif // MUTILATE_H
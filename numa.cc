@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "numa.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+using namespace std;
+
+static vector<numa_node_t> topology;
+static vector<int> plan;  // Indices into topology, in placement order.
+
+static bool parse_cpulist(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+
+  const char *p = list;
+  while (*p && *p != '\n') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p) return false;
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) return false;
+    }
+    for (long c = first; c <= last && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+    p = *end == ',' ? end + 1 : end;
+  }
+
+  return true;
+}
+
+static bool read_line(const char *path, char *buf, int size) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return false;
+  bool ok = fgets(buf, size, file) != NULL;
+  fclose(file);
+  return ok;
+}
+
+static void read_topology() {
+  char path[256], buf[4096];
+
+  for (int n = 0; n < CPU_SETSIZE; n++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    if (!read_line(path, buf, sizeof(buf))) continue;
+
+    numa_node_t node;
+    node.id = n;
+    if (!parse_cpulist(buf, &node.cpus))
+      DIE("Unable to parse %s: %s", path, buf);
+    if (CPU_COUNT(&node.cpus) == 0) continue;  // Memory-only node.
+
+    topology.push_back(node);
+  }
+
+  if (topology.size() == 0) {
+    W("No NUMA topology in sysfs; assuming a single node.");
+    numa_node_t node;
+    node.id = 0;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &node.cpus))
+      DIE("sched_getaffinity() failed: %s", strerror(errno));
+    topology.push_back(node);
+  }
+}
+
+static int topology_index(int id) {
+  for (unsigned int i = 0; i < topology.size(); i++)
+    if (topology[i].id == id) return i;
+  return -1;
+}
+
+int numa_nic_node(const char *ifname) {
+  char path[256], buf[64];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+  if (!read_line(path, buf, sizeof(buf))) return -1;
+  return atoi(buf);
+}
+
+void numa_init(const char *policy) {
+  read_topology();
+
+  for (auto &n: topology)
+    V("NUMA node %d: CPUs %s", n.id, cpuset_to_string(&n.cpus).c_str());
+
+  if (!strcmp(policy, "all")) {
+    for (unsigned int i = 0; i < topology.size(); i++) plan.push_back(i);
+  } else if (!strncmp(policy, "node:", 5)) {
+    char *s_copy = strdup(policy + 5);
+    char *saveptr = NULL;
+
+    for (char *tok = strtok_r(s_copy, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+      int i = topology_index(atoi(tok));
+      if (i < 0) DIE("--numa: node %s has no CPUs", tok);
+      plan.push_back(i);
+    }
+
+    free(s_copy);
+  } else if (!strncmp(policy, "nic:", 4)) {
+    int node = numa_nic_node(policy + 4);
+    int i = topology_index(node);
+
+    if (i < 0) {
+      W("--numa: NUMA node of %s unknown; using all nodes.", policy + 4);
+      for (unsigned int i = 0; i < topology.size(); i++) plan.push_back(i);
+    } else {
+      I("%s is local to NUMA node %d.", policy + 4, node);
+      plan.push_back(i);
+    }
+  } else {
+    DIE("--numa: unknown policy '%s'", policy);
+  }
+
+  if (plan.size() == 0) DIE("--numa: no nodes selected");
+}
+
+int numa_place(int index, const cpu_set_t *allowed, bool single_cpu,
+               cpu_set_t *mask) {
+  vector<numa_node_t*> candidates;
+
+  for (auto i: plan) {
+    cpu_set_t both;
+    CPU_AND(&both, &topology[i].cpus, allowed);
+    if (CPU_COUNT(&both) > 0) candidates.push_back(&topology[i]);
+  }
+
+  if (candidates.size() == 0)
+    DIE("--numa: selected nodes have no CPUs we are allowed to run on");
+
+  numa_node_t *node = candidates[index % candidates.size()];
+  CPU_AND(mask, &node->cpus, allowed);
+
+  if (single_cpu) {
+    int want = (index / candidates.size()) % CPU_COUNT(mask);
+    int n = 0;
+
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+      if (!CPU_ISSET(c, mask)) continue;
+      if (n++ == want) {
+        CPU_ZERO(mask);
+        CPU_SET(c, mask);
+        break;
+      }
+    }
+  }
+
+  return node->id;
+}
+
+void numa_bind_memory(int node) {
+  unsigned long nodemask[16] = {0};
+  if (node < 0 || node >= (int) (8 * sizeof(nodemask))) return;
+
+  nodemask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+              8 * sizeof(nodemask)))
+    W("set_mempolicy(node %d) failed: %s", node, strerror(errno));
+}
+
+string cpuset_to_string(const cpu_set_t *set) {
+  string s;
+  char buf[32];
+
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (!CPU_ISSET(c, set)) continue;
+
+    int last = c;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+
+    if (last == c) snprintf(buf, sizeof(buf), "%s%d", s.size() ? "," : "", c);
+    else snprintf(buf, sizeof(buf), "%s%d-%d", s.size() ? "," : "", c, last);
+    s += buf;
+
+    c = last;
+  }
+
+  return s;
+}
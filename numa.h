@@ -0,0 +1,40 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <sched.h>
+
+#include <string>
+#include <vector>
+
+struct numa_node_t {
+  int id;
+  cpu_set_t cpus;
+};
+
+// Parse a --numa policy and read the topology from sysfs.  Policies:
+//
+//   all            Spread threads round-robin over every node.
+//   node:<n>[,..]  Spread threads over the given nodes only.
+//   nic:<ifname>   Keep threads on the node local to <ifname>.
+//
+// Machines without /sys/devices/system/node look like one node 0
+// holding every CPU.
+void numa_init(const char *policy);
+
+// Pick the node (returned) and CPUs (in mask) for the index-th thread
+// or process, restricted to the CPUs in allowed.  With single_cpu,
+// consecutive indices on the same node get different single CPUs.
+int numa_place(int index, const cpu_set_t *allowed, bool single_cpu,
+               cpu_set_t *mask);
+
+// Prefer the given node for all future allocations by the calling
+// thread (and threads it creates).  Combined with first-touch this
+// puts a thread's event_base, Connections and buffers on its node.
+void numa_bind_memory(int node);
+
+// NUMA node a network interface is attached to, or -1 if unknown.
+int numa_nic_node(const char *ifname);
+
+std::string cpuset_to_string(const cpu_set_t *set);
+
+#endif // NUMA_H
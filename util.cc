@@ -1,15 +1,117 @@
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "log.h"
 #include "mutilate.h"
 #include "util.h"
 
+bool tsc_enabled = false;
+uint64_t tsc_base;
+int64_t tsc_base_ns;
+double tsc_ns_per_cycle;
+
+// The kernel advertises a TSC that ticks at a constant rate through
+// frequency changes and deep C-states with these two flags.
+static bool tsc_invariant() {
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return false;
+
+  char line[4096];
+  bool found = false;
+
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "flags", 5)) continue;
+    found = strstr(line, " constant_tsc") && strstr(line, " nonstop_tsc") &&
+      strstr(line, " rdtscp");
+    break;
+  }
+
+  fclose(f);
+  return found;
+}
+
+// Take a (TSC, CLOCK_MONOTONIC) pair, bracketing the clock read
+// tightly enough that the pair is good to a few cycles.
+static void tsc_sample(uint64_t *tsc, int64_t *ns) {
+  uint64_t best = UINT64_MAX;
+
+  *tsc = 0;
+  *ns = 0;
+
+  for (int i = 0; i < 5; i++) {
+    uint64_t t0 = rdtscp();
+    int64_t n = get_monotonic_ns();
+    uint64_t t1 = rdtscp();
+
+    if (t1 - t0 < best) {
+      best = t1 - t0;
+      *tsc = t0 + (t1 - t0) / 2;
+      *ns = n;
+    }
+  }
+}
+
+// Nanoseconds per TSC cycle over a `duration' second busy-wait.
+static double tsc_calibrate(double duration) {
+  uint64_t tsc0, tsc1;
+  int64_t ns0, ns1;
+
+  tsc_sample(&tsc0, &ns0);
+  while (get_monotonic_ns() - ns0 < duration * 1000000000) ;
+  tsc_sample(&tsc1, &ns1);
+
+  if (tsc1 <= tsc0) return 0.0;
+  return (double) (ns1 - ns0) / (tsc1 - tsc0);
+}
+
+void clock_init() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (!tsc_invariant()) {
+    V("TSC is not invariant; timing with CLOCK_MONOTONIC.");
+    return;
+  }
+
+  double a = tsc_calibrate(0.010);
+  double b = tsc_calibrate(0.010);
+
+  if (a <= 0.0 || b <= 0.0 || fabs(a - b) / a > 0.001) {
+    W("TSC calibration unstable (%f vs %f ns/cycle); "
+      "timing with CLOCK_MONOTONIC.", a, b);
+    return;
+  }
+
+  tsc_ns_per_cycle = (a + b) / 2;
+  tsc_sample(&tsc_base, &tsc_base_ns);
+  tsc_enabled = true;
+
+  V("TSC clock: %.3f GHz.", 1 / tsc_ns_per_cycle);
+#else
+  V("No TSC; timing with CLOCK_MONOTONIC.");
+#endif
+}
+
 void sleep_time(double duration) {
   if (duration > 0) usleep((useconds_t) (duration * 1000000));
 }
 
+uint64_t raise_fd_limit() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl)) return 0;
+
+  if (rl.rlim_cur < rl.rlim_max) {
+    rlim_t soft = rl.rlim_cur;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl)) rl.rlim_cur = soft;
+  }
+
+  return rl.rlim_cur;
+}
+
 #define FNV_64_PRIME (0x100000001b3ULL)
 #define FNV1_64_INIT (0xcbf29ce484222325ULL)
 uint64_t fnv_64_buf(const void* buf, size_t len) {
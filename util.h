@@ -1,6 +1,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <inttypes.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -16,34 +17,62 @@ inline void double_to_tv(double val, struct timeval *tv) {
   tv->tv_usec = usecs;
 }
 
-inline double get_time_accurate() {
-#if USE_CLOCK_GETTIME
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-  //  clock_gettime(CLOCK_REALTIME, &ts);
-  return ts.tv_sec + (double) ts.tv_nsec / 1000000000;
+inline void ns_to_tv(int64_t ns, struct timeval *tv) {
+  if (ns < 0) ns = 0;
+  tv->tv_sec = ns / 1000000000;
+  tv->tv_usec = (ns % 1000000000) / 1000;
+}
+
+// All timestamps come from one monotonic clock, in nanoseconds.  After
+// clock_init() has calibrated it against CLOCK_MONOTONIC, it is read
+// from the TSC; if the TSC is not invariant, or calibration does not
+// agree with itself, it stays on clock_gettime(CLOCK_MONOTONIC).
+
+extern bool tsc_enabled;
+extern uint64_t tsc_base;
+extern int64_t tsc_base_ns;
+extern double tsc_ns_per_cycle;
+
+void clock_init();
+
+inline uint64_t rdtscp() {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtscp" : "=a" (lo), "=d" (hi) :: "rcx");
+  return ((uint64_t) hi << 32) | lo;
 #else
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv_to_double(&tv);
+  return 0;
 #endif
 }
 
+inline int64_t get_monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+inline int64_t get_ns() {
+  if (tsc_enabled)
+    return tsc_base_ns + (int64_t) ((rdtscp() - tsc_base) * tsc_ns_per_cycle);
+  return get_monotonic_ns();
+}
+
 inline double get_time() {
-  //#if USE_CLOCK_GETTIME
-  //  struct timespec ts;
-  //  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-  //  //  clock_gettime(CLOCK_REALTIME, &ts);
-  //  return ts.tv_sec + (double) ts.tv_nsec / 1000000000;
-  //#else
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv_to_double(&tv);
-  //#endif
+  return get_ns() / 1000000000.0;
+}
+
+inline double get_thread_cpu_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + (double) ts.tv_nsec / 1000000000;
 }
 
 void sleep_time(double duration);
 
+// Raise the soft RLIMIT_NOFILE as far as the hard limit allows and
+// return it.
+uint64_t raise_fd_limit();
+
 uint64_t fnv_64_buf(const void* buf, size_t len);
 inline uint64_t fnv_64(uint64_t in) { return fnv_64_buf(&in, sizeof(in)); }
 